@@ -0,0 +1,249 @@
+#ifndef ALLOCHOOKS_H
+#define ALLOCHOOKS_H
+
+/**
+ * 堆分配计数，epollserverdemo 和 epollframeserverdemo 共用，只在测试构建里打开：g++ -DALLOC_HOOKS ...
+ *
+ * 替换全局的 operator new/delete 和 malloc 系列，每次分配计数加一，再转给 glibc 的 __libc_malloc 系列。
+ * 对齐分配也算在内：posix_memalign/aligned_alloc/memalign/valloc/pvalloc 和带 std::align_val_t 的 operator new。
+ * 直接 mmap/brk 拿内存的不经过这里，不计数。
+ * 事件循环每一轮开始和结束各取一次计数，差值就是这一轮的分配次数。
+ * 有连接建立或断开的轮次允许分配，前 ALLOC_WARMUP 轮（默认 1000）是预热，也不算；
+ * 其余的轮次都是稳态的收发路径，应该一次分配都没有。退出时有这样的轮次，进程退出码为 1。
+ * 设置环境变量 ALLOC_ASSERT=1 时，稳态下第一次分配就 abort()，在调试器里能直接看到是谁分配的。
+ *
+ * 这里定义的是全局的 malloc/operator new，一个程序只能有一个源文件包含它。
+ * 不定义 ALLOC_HOOKS 时只有几个空函数，事件循环里的调用会被编译器去掉。
+ * */
+#ifdef ALLOC_HOOKS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <new>
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t nmemb, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+extern "C" void *__libc_memalign(size_t alignment, size_t size);
+extern "C" void *__libc_valloc(size_t size);
+extern "C" void *__libc_pvalloc(size_t size);
+extern "C" void __libc_free(void *ptr);
+
+struct allocstats
+{
+    unsigned long long mallocs;         // malloc 系列（含对齐分配）的次数
+    unsigned long long news;            // operator new/new[] 的次数
+    unsigned long long iterations;
+    unsigned long long churn;           // 预热之后、有连接建立或断开的轮次
+    unsigned long long steady;          // 预热之后、没有连接变化的轮次
+    unsigned long long violations;      // 稳态轮次中发生了分配的轮次
+    unsigned long long violating;       // 这些轮次里的分配次数
+    unsigned long long warmup;
+    unsigned long long start;           // 本轮开始时的计数
+    bool churned;
+    bool abort;
+};
+
+static struct allocstats allocs;
+
+extern "C" void *malloc(size_t size)
+{
+    allocs.mallocs++;
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t nmemb, size_t size)
+{
+    allocs.mallocs++;
+    return __libc_calloc(nmemb, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+    allocs.mallocs++;
+    return __libc_realloc(ptr, size);
+}
+
+extern "C" void *reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+    size_t total;
+    if (__builtin_mul_overflow(nmemb, size, &total))
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, total);
+}
+
+extern "C" void *memalign(size_t alignment, size_t size)
+{
+    allocs.mallocs++;
+    return __libc_memalign(alignment, size);
+}
+
+extern "C" void *aligned_alloc(size_t alignment, size_t size)
+{
+    allocs.mallocs++;
+    return __libc_memalign(alignment, size);
+}
+
+// 和 glibc 一样：对齐必须是 2 的幂且是 sizeof(void *) 的倍数，失败时不改 errno，返回错误码
+extern "C" int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0 || alignment == 0)
+        return EINVAL;
+    allocs.mallocs++;
+    int saved = errno;
+    void *p = __libc_memalign(alignment, size);
+    errno = saved;
+    if (p == NULL)
+        return ENOMEM;
+    *memptr = p;
+    return 0;
+}
+
+extern "C" void *valloc(size_t size)
+{
+    allocs.mallocs++;
+    return __libc_valloc(size);
+}
+
+extern "C" void *pvalloc(size_t size)
+{
+    allocs.mallocs++;
+    return __libc_pvalloc(size);
+}
+
+extern "C" void free(void *ptr)
+{
+    __libc_free(ptr);
+}
+
+// 不经过上面的 malloc，new 和 malloc 分开计数
+void *operator new(size_t size)
+{
+    allocs.news++;
+    void *p = __libc_malloc(size > 0 ? size : 1);
+    if (p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    allocs.news++;
+    return __libc_malloc(size > 0 ? size : 1);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+    return operator new(size, std::nothrow);
+}
+
+// alignas 超过 __STDCPP_DEFAULT_NEW_ALIGNMENT__ 的类型走这几个
+void *operator new(size_t size, std::align_val_t al)
+{
+    allocs.news++;
+    void *p = __libc_memalign(static_cast<size_t>(al), size > 0 ? size : 1);
+    if (p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t size, std::align_val_t al)
+{
+    return operator new(size, al);
+}
+
+void *operator new(size_t size, std::align_val_t al, const std::nothrow_t &) noexcept
+{
+    allocs.news++;
+    return __libc_memalign(static_cast<size_t>(al), size > 0 ? size : 1);
+}
+
+void *operator new[](size_t size, std::align_val_t al, const std::nothrow_t &) noexcept
+{
+    return operator new(size, al, std::nothrow);
+}
+
+void operator delete(void *ptr) noexcept { __libc_free(ptr); }
+void operator delete[](void *ptr) noexcept { __libc_free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { __libc_free(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { __libc_free(ptr); }
+void operator delete(void *ptr, const std::nothrow_t &) noexcept { __libc_free(ptr); }
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept { __libc_free(ptr); }
+void operator delete(void *ptr, std::align_val_t) noexcept { __libc_free(ptr); }
+void operator delete[](void *ptr, std::align_val_t) noexcept { __libc_free(ptr); }
+void operator delete(void *ptr, size_t, std::align_val_t) noexcept { __libc_free(ptr); }
+void operator delete[](void *ptr, size_t, std::align_val_t) noexcept { __libc_free(ptr); }
+void operator delete(void *ptr, std::align_val_t, const std::nothrow_t &) noexcept { __libc_free(ptr); }
+void operator delete[](void *ptr, std::align_val_t, const std::nothrow_t &) noexcept { __libc_free(ptr); }
+
+static void allocinit()
+{
+    const char *s = getenv("ALLOC_WARMUP");
+    allocs.warmup = s != NULL ? strtoull(s, NULL, 10) : 1000;
+    s = getenv("ALLOC_ASSERT");
+    allocs.abort = s != NULL && atoi(s) > 0;
+}
+
+static inline void allocbegin()
+{
+    allocs.start = allocs.mallocs + allocs.news;
+    allocs.churned = false;
+}
+
+// 本轮有连接建立或断开，分配连接缓冲区、打印日志都是允许的
+static inline void allocchurn()
+{
+    allocs.churned = true;
+}
+
+static inline void allocend()
+{
+    unsigned long long n = allocs.mallocs + allocs.news - allocs.start;
+    if (allocs.iterations++ < allocs.warmup)
+        return;
+    if (allocs.churned)
+    {
+        allocs.churn++;
+        return;
+    }
+
+    allocs.steady++;
+    if (n == 0)
+        return;
+    allocs.violations++;
+    allocs.violating += n;
+    if (allocs.abort)
+    {
+        fprintf(stderr, "%llu heap allocations in steady-state iteration %llu\n", n, allocs.iterations);
+        abort();
+    }
+}
+
+// 标准输出是收发日志，统计写到标准错误
+static int allocreport()
+{
+    fprintf(stderr, "allocations: malloc=%llu new=%llu, iterations=%llu (warmup=%llu churn=%llu steady=%llu)\n",
+            allocs.mallocs, allocs.news, allocs.iterations,
+            allocs.iterations < allocs.warmup ? allocs.iterations : allocs.warmup, allocs.churn, allocs.steady);
+    fprintf(stderr, "steady-state iterations with allocations: %llu (%llu allocations)\n",
+            allocs.violations, allocs.violating);
+    return allocs.violations > 0 ? 1 : 0;
+}
+#else
+static inline void allocinit() {}
+static inline void allocbegin() {}
+static inline void allocchurn() {}
+static inline void allocend() {}
+static inline int allocreport() { return 0; }
+#endif
+
+#endif
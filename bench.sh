@@ -0,0 +1,137 @@
+#!/bin/sh
+# epollserverdemo 压测脚本
+#
+# 依次用不同的 socket 调优参数启动 epollserverdemo，用 benchclient 在不同消息大小和流水线深度下压测，
+# 每种组合输出一行结果，便于比较每个选项单独的效果。
+#
+# 然后对比 loopback TCP、Unix domain socket 和共享内存环形缓冲区几种传输方式。
+#
+# 最后用 -DALLOC_HOOKS 编译 epollserverdemo 和 epollframeserverdemo，压测之后检查稳态收发路径上没有堆分配，
+# 有分配时脚本退出码为 1。再把一串流水线 RESP 命令发给 epollrespserverdemo，回复不对时退出码也为 1。
+#
+# 用法：./bench.sh [port]
+
+PORT=${1:-5005}
+HOST=127.0.0.1
+
+g++ -O2 -o epollserverdemo epollserverdemo.cpp || exit 1
+g++ -std=c++17 -O2 -o benchclient benchclient.cpp || exit 1
+g++ -std=c++17 -O2 -o shmringdemo shmringdemo.cpp || exit 1
+
+# 服务端调优参数：两个预设，以及逐个单独打开的选项
+PROFILES="default latency throughput nodelay quickack notsentlowat=16384 rcvbuf=4194304,sndbuf=4194304 fastopen=256"
+# 消息大小:流水线深度
+WORKLOADS="64:1 64:16 16384:1 16384:8"
+
+for profile in $PROFILES; do
+    ./epollserverdemo $PORT $profile > /dev/null &
+    server=$!
+    sleep 0.2
+
+    # 客户端打开与服务端同名的选项（只取客户端有意义的部分）
+    case $profile in
+        latency) client=nodelay,quickack,fastopen=1 ;;
+        throughput) client=rcvbuf=4194304,sndbuf=4194304 ;;
+        nodelay|quickack|fastopen=*|rcvbuf=*) client=$profile ;;
+        *) client=default ;;
+    esac
+
+    for workload in $WORKLOADS; do
+        size=${workload%:*}
+        depth=${workload#*:}
+        printf "server=%-32s " "$profile"
+        ./benchclient -c 20 -n 2000 -s $size -d $depth -o $client $HOST $PORT
+    done
+
+    kill $server
+    wait $server 2>/dev/null
+done
+
+# 传输方式对比：loopback TCP 与 Unix domain socket（字节流和 seqpacket）
+SOCKPATH=/tmp/epollserverdemo.sock
+for transport in tcp unix seqpacket; do
+    case $transport in
+        tcp) listen=$PORT; target="$HOST $PORT" ;;
+        *) listen=$transport:$SOCKPATH; target=$transport:$SOCKPATH ;;
+    esac
+
+    ./epollserverdemo $listen > /dev/null &
+    server=$!
+    sleep 0.2
+
+    # epollserverdemo 每次最多读 1024 字节，seqpacket 一条消息超出的部分会被截断丢弃，大消息只用字节流测
+    for workload in 64:1 64:16 1024:1 16384:1; do
+        size=${workload%:*}
+        depth=${workload#*:}
+        if [ $transport = seqpacket ] && [ $size -gt 1024 ]; then
+            continue
+        fi
+        printf "transport=%-29s " "$transport"
+        ./benchclient -c 20 -n 2000 -s $size -d $depth -o nodelay $target
+    done
+
+    kill $server
+    wait $server 2>/dev/null
+done
+rm -f $SOCKPATH
+
+# 共享内存环形缓冲区，一问一答（对应上面 depth=1 的结果）
+SHMPATH=/tmp/shmringdemo.sock
+./shmringdemo server $SHMPATH > /dev/null &
+server=$!
+sleep 0.2
+for size in 64 1024 16384; do
+    ./shmringdemo bench $SHMPATH -n 40000 -s $size
+done
+kill $server
+wait $server 2>/dev/null
+rm -f $SHMPATH
+
+# 稳态零分配检查：压测结束后 Ctrl-C，服务端把分配统计写到标准错误，稳态下有分配时退出码为 1
+g++ -O2 -DALLOC_HOOKS -o epollserverdemo.alloc epollserverdemo.cpp || exit 1
+g++ -O2 -DALLOC_HOOKS -o epollframeserverdemo.alloc epollframeserverdemo.cpp || exit 1
+failed=0
+for server in epollserverdemo epollframeserverdemo; do
+    case $server in
+        epollframeserverdemo) framing=-f ;;
+        *) framing= ;;
+    esac
+
+    ./$server.alloc $PORT > /dev/null 2> /tmp/$server.alloc.log &
+    pid=$!
+    sleep 0.2
+    result=ok
+    for workload in 64:1 64:16 1024:1 1024:8; do
+        size=${workload%:*}
+        depth=${workload#*:}
+        ./benchclient -c 20 -n 2000 -s $size -d $depth -o nodelay $framing $HOST $PORT > /dev/null || result=FAILED
+    done
+
+    kill -INT $pid
+    wait $pid || result=FAILED
+    if [ $result != ok ]; then
+        failed=1
+    fi
+    printf "alloc server=%-21s %-6s " "$server" "$result"
+    tail -n 1 /tmp/$server.alloc.log
+    rm -f /tmp/$server.alloc.log
+done
+
+# RESP 协议检查：一次写入多条命令，其中有空值数组 *-1 和空数组 *0，两者都应该被跳过，
+# 其余命令的回复按顺序对上，最后 QUIT 由服务端关闭连接，服务端不能因为任何一条命令退出
+g++ -std=c++20 -O2 -o epollrespserverdemo epollrespserverdemo.cpp || exit 1
+./epollrespserverdemo $PORT > /dev/null &
+pid=$!
+sleep 0.2
+request='*-1\r\nPING\r\n*0\r\n*2\r\n$4\r\nECHO\r\n$2\r\nhi\r\n*-1\r\n*1\r\n$4\r\nQUIT\r\n'
+expected=$(printf '+PONG\r\n$2\r\nhi\r\n+OK\r\n')
+reply=$(bash -c 'exec 3<>/dev/tcp/$0/$1 && printf "$2" >&3 && timeout 2 cat <&3' $HOST $PORT "$request")
+result=ok
+if [ "$reply" != "$expected" ] || ! kill -0 $pid 2>/dev/null; then
+    result=FAILED
+    failed=1
+fi
+printf "resp server=%-22s %s\n" epollrespserverdemo "$result"
+kill $pid 2>/dev/null
+wait $pid 2>/dev/null
+exit $failed
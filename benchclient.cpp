@@ -0,0 +1,350 @@
+/**
+ * echo 服务端压测客户端
+ *
+ * 用一个 epoll 循环驱动 -c 个连接，每个连接上保持 -d 条消息在途（-d 1 就是一问一答，大于 1 就是流水线），
+ * 每条消息 -s 字节，服务端原样回显。从开始发送一条消息到收齐它的回显记为一次往返延迟。
+ * 所有连接各完成 -n 条消息后输出：
+ *     rps        每秒完成的消息数
+ *     MB/s       每秒回显的数据量
+ *     p50/p99/p999 往返延迟分位数
+ *     connect    平均建连耗时（观察 TCP_FASTOPEN 的效果）
+ *
+ * 服务端地址可以是 "ip port"，也可以是 unix:path 或 seqpacket:path（Unix domain socket，对比绕过 TCP/IP 协议栈的收益）
+ *
+ * -o 是客户端这一侧的 socket 参数，写法和 epollserverdemo 的调优参数一样：nodelay,rcvbuf=N,sndbuf=N,quickack,fastopen
+ *
+ * -f 时每条消息的前 4 字节是大端序的 payload 长度（-s 减 4），用来压测 epollframeserverdemo
+ *
+ * 编译：g++ -std=c++17 -O2 -o benchclient benchclient.cpp
+ * 示例：./benchclient -c 50 -n 20000 -s 64 -d 1 -o nodelay 127.0.0.1 5005
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <sys/fcntl.h>
+#include <algorithm>
+#include <vector>
+
+#define MAXEVENTS 1024
+
+static long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+struct options
+{
+    int conns;
+    long msgs;
+    int size;
+    int depth;
+    int nodelay;
+    int rcvbuf;
+    int sndbuf;
+    int quickack;
+    int fastopen;
+};
+
+// 与 epollserverdemo.cpp 的 parseprofile 相同的写法，客户端只关心其中几项
+static int parseoptions(const char *spec, struct options *o)
+{
+    char buf[256];
+    strncpy(buf, spec, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+
+    char *saveptr;
+    for (char *opt = strtok_r(buf, ",", &saveptr); opt != NULL; opt = strtok_r(NULL, ",", &saveptr))
+    {
+        char *eq = strchr(opt, '=');
+        int value = 1;
+        if (eq != NULL)
+        {
+            *eq = '\0';
+            value = atoi(eq + 1);
+        }
+
+        if (strcmp(opt, "nodelay") == 0)
+            o->nodelay = value;
+        else if (strcmp(opt, "rcvbuf") == 0)
+            o->rcvbuf = value;
+        else if (strcmp(opt, "sndbuf") == 0)
+            o->sndbuf = value;
+        else if (strcmp(opt, "quickack") == 0)
+            o->quickack = value;
+        else if (strcmp(opt, "fastopen") == 0)
+            o->fastopen = value;
+        else if (strcmp(opt, "default") != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static void setopt(int sock, int level, int name, int value)
+{
+    if (value >= 0)
+        setsockopt(sock, level, name, &value, sizeof(value));
+}
+
+struct bconn
+{
+    int fd;
+    long tosend;            // 还需要开始发送的消息数
+    long torecv;            // 还需要收齐的消息数
+    int outleft;            // 当前消息还剩多少字节没写出去，0 表示没有正在写的消息
+    int inleft;             // 队头消息还差多少字节回显
+    std::vector<long long> started;  // 在途消息的开始时间，环形队列
+    size_t head;
+    size_t tail;
+};
+
+static std::vector<unsigned int> latencies;   // 纳秒
+static char *payload;
+static struct options opts;
+static bool framed = false;
+static bool unixsock;
+
+// 在允许的在途深度内尽量多发
+static int pump(struct bconn *c)
+{
+    while (c->outleft > 0 || (c->tosend > 0 && (c->tail - c->head) < (size_t)opts.depth))
+    {
+        if (c->outleft == 0)
+        {
+            c->started[c->tail++ % opts.depth] = now_ns();
+            c->outleft = opts.size;
+            c->tosend--;
+        }
+
+        ssize_t n = write(c->fd, payload + (opts.size - c->outleft), c->outleft);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        c->outleft -= n;
+    }
+    return 0;
+}
+
+static int drain(struct bconn *c)
+{
+    static char buf[256 * 1024];
+
+    for (;;)
+    {
+        ssize_t n = read(c->fd, buf, sizeof(buf));
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        if (n == 0)
+            return -1;
+
+        if (opts.quickack > 0 && !unixsock)
+            setsockopt(c->fd, IPPROTO_TCP, TCP_QUICKACK, &opts.quickack, sizeof(int));
+
+        // 按消息边界切分收到的字节，每收齐一条记录一次延迟
+        while (n > 0)
+        {
+            int take = n < c->inleft ? n : c->inleft;
+            c->inleft -= take;
+            n -= take;
+            if (c->inleft == 0)
+            {
+                latencies.push_back(now_ns() - c->started[c->head++ % opts.depth]);
+                c->torecv--;
+                c->inleft = opts.size;
+            }
+        }
+    }
+}
+
+static double percentile(double p)
+{
+    if (latencies.empty())
+        return 0;
+    size_t k = (size_t)(p * (latencies.size() - 1));
+    return latencies[k] / 1000.0;
+}
+
+int main(int argc, char *argv[])
+{
+    opts = {10, 10000, 64, 1, -1, -1, -1, -1, -1};
+    const char *spec = "default";
+
+    int ch;
+    bool bad = false;
+    while ((ch = getopt(argc, argv, "c:n:s:d:o:f")) != -1)
+    {
+        switch (ch)
+        {
+        case 'c': opts.conns = atoi(optarg); break;
+        case 'n': opts.msgs = atol(optarg); break;
+        case 's': opts.size = atoi(optarg); break;
+        case 'd': opts.depth = atoi(optarg); break;
+        case 'o': spec = optarg; break;
+        case 'f': framed = true; break;
+        default: bad = true; break;
+        }
+    }
+
+    // 一个参数时是 unix:path 或 seqpacket:path
+    unixsock = optind == argc - 1;
+    if (bad || (optind != argc - 2 && !unixsock) || parseoptions(spec, &opts) != 0 || opts.size <= (framed ? 4 : 0) || opts.depth <= 0)
+    {
+        printf("usage: ./benchclient [-c conns] [-n msgs_per_conn] [-s size] [-d depth] [-o options] [-f] ip port|unix:path|seqpacket:path\n");
+        return -1;
+    }
+
+    payload = (char *)malloc(opts.size);
+    for (int i = 0; i < opts.size; i++)
+        payload[i] = 'a' + i % 26;
+    if (framed)
+    {
+        uint32_t len = htonl(opts.size - 4);
+        memcpy(payload, &len, 4);
+    }
+
+    struct sockaddr_storage servaddr;
+    socklen_t addrlen;
+    int family = AF_INET;
+    int type = SOCK_STREAM;
+    memset(&servaddr, 0, sizeof(servaddr));
+
+    if (unixsock)
+    {
+        const char *path;
+        if (strncmp(argv[optind], "unix:", 5) == 0)
+            path = argv[optind] + 5;
+        else if (strncmp(argv[optind], "seqpacket:", 10) == 0)
+        {
+            path = argv[optind] + 10;
+            type = SOCK_SEQPACKET;
+        }
+        else
+        {
+            printf("bad address: %s\n", argv[optind]);
+            return -1;
+        }
+
+        struct sockaddr_un *un = (struct sockaddr_un *)&servaddr;
+        un->sun_family = AF_UNIX;
+        strncpy(un->sun_path, path, sizeof(un->sun_path) - 1);
+        addrlen = sizeof(struct sockaddr_un);
+        family = AF_UNIX;
+    }
+    else
+    {
+        struct sockaddr_in *in = (struct sockaddr_in *)&servaddr;
+        in->sin_family = AF_INET;
+        in->sin_port = htons(atoi(argv[optind + 1]));
+        in->sin_addr.s_addr = inet_addr(argv[optind]);
+        addrlen = sizeof(struct sockaddr_in);
+    }
+
+    int epollfd = epoll_create(1);
+    std::vector<struct bconn> conns(opts.conns);
+    latencies.reserve((size_t)opts.conns * opts.msgs);
+
+    long long connecttime = 0;
+    for (int i = 0; i < opts.conns; i++)
+    {
+        struct bconn *c = &conns[i];
+        c->fd = socket(family, type, 0);
+
+        setopt(c->fd, SOL_SOCKET, SO_RCVBUF, opts.rcvbuf);
+        setopt(c->fd, SOL_SOCKET, SO_SNDBUF, opts.sndbuf);
+        if (family == AF_INET)
+        {
+            setopt(c->fd, IPPROTO_TCP, TCP_NODELAY, opts.nodelay);
+            setopt(c->fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, opts.fastopen > 0 ? 1 : -1);
+        }
+
+        long long start = now_ns();
+        if (connect(c->fd, (struct sockaddr *)&servaddr, addrlen) != 0)
+        {
+            printf("connect(%s) failed.\n", argv[optind]);
+            return -1;
+        }
+        connecttime += now_ns() - start;
+
+        fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL, 0) | O_NONBLOCK);
+
+        c->tosend = opts.msgs;
+        c->torecv = opts.msgs;
+        c->outleft = 0;
+        c->inleft = opts.size;
+        c->started.resize(opts.depth);
+        c->head = 0;
+        c->tail = 0;
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.data.u32 = i;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        epoll_ctl(epollfd, EPOLL_CTL_ADD, c->fd, &ev);
+    }
+
+    long long start = now_ns();
+    int remaining = opts.conns;
+
+    while (remaining > 0)
+    {
+        struct epoll_event events[MAXEVENTS];
+        int readyfds = epoll_wait(epollfd, events, MAXEVENTS, 5000);
+        if (readyfds <= 0)
+        {
+            printf("benchmark stalled.\n");
+            return -1;
+        }
+
+        for (int i = 0; i < readyfds; i++)
+        {
+            struct bconn *c = &conns[events[i].data.u32];
+            if (c->torecv == 0)
+                continue;
+
+            if (drain(c) < 0 || pump(c) < 0)
+            {
+                printf("connection lost.\n");
+                return -1;
+            }
+
+            if (c->torecv == 0)
+            {
+                epoll_ctl(epollfd, EPOLL_CTL_DEL, c->fd, NULL);
+                remaining--;
+            }
+        }
+    }
+
+    double seconds = (now_ns() - start) / 1e9;
+    std::sort(latencies.begin(), latencies.end());
+
+    double total = (double)opts.conns * opts.msgs;
+    printf("conns=%d depth=%d size=%d opts=%s msgs=%.0f rps=%.0f MB/s=%.1f p50=%.1fus p99=%.1fus p999=%.1fus connect=%.1fus\n",
+           opts.conns, opts.depth, opts.size, spec, total, total / seconds,
+           total * opts.size / seconds / 1e6, percentile(0.5), percentile(0.99), percentile(0.999),
+           connecttime / 1000.0 / opts.conns);
+
+    for (int i = 0; i < opts.conns; i++)
+        close(conns[i].fd);
+    close(epollfd);
+
+    return 0;
+}
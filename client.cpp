@@ -5,13 +5,41 @@
 #include <string.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 
+// 连接同一台机器上的 Unix domain socket 服务端，type 为 SOCK_STREAM 或 SOCK_SEQPACKET
+static int connectunix(const char *path, int type)
+{
+    int sockfd;
+    struct sockaddr_un servaddr;
+
+    if ((sockfd = socket(AF_UNIX, type, 0)) < 0)
+    {
+        printf("socket() failed.\n");
+        return -1;
+    }
+
+    memset(&servaddr, 0, sizeof(servaddr));
+    servaddr.sun_family = AF_UNIX;
+    strncpy(servaddr.sun_path, path, sizeof(servaddr.sun_path) - 1);
+
+    if (connect(sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) != 0)
+    {
+        printf("connect(%s) failed.\n", path);
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
 int main(int argc, char *argv[])
 {
-    if (argc != 3)
+    if (argc != 3 && !(argc == 2 && strchr(argv[1], ':') != NULL))
     {
         printf("usage:./tcpclient ip port\n");
+        printf("      ./tcpclient unix:path|seqpacket:path\n");
         return -1;
     }
 
@@ -20,23 +48,38 @@ int main(int argc, char *argv[])
     struct sockaddr_in servaddr;
     char buf[1024];
 
-    // 创建一个ipv4 socket
-    if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    if (argc == 2)
     {
-        printf("socket() failed.\n");
-        return -1;
+        if (strncmp(argv[1], "unix:", 5) == 0)
+            sockfd = connectunix(argv[1] + 5, SOCK_STREAM);
+        else if (strncmp(argv[1], "seqpacket:", 10) == 0)
+            sockfd = connectunix(argv[1] + 10, SOCK_SEQPACKET);
+        else
+            sockfd = -1;
+
+        if (sockfd < 0)
+            return -1;
     }
+    else
+    {
+        // 创建一个ipv4 socket
+        if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        {
+            printf("socket() failed.\n");
+            return -1;
+        }
 
-    memset(&servaddr, 0, sizeof(servaddr));
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_port = htons(atoi(argv[2]));
-    servaddr.sin_addr.s_addr = inet_addr(argv[1]);
+        memset(&servaddr, 0, sizeof(servaddr));
+        servaddr.sin_family = AF_INET;
+        servaddr.sin_port = htons(atoi(argv[2]));
+        servaddr.sin_addr.s_addr = inet_addr(argv[1]);
 
-    if (connect(sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) != 0)
-    {
-        printf("connect(%s:%s) failed.\n", argv[1], argv[2]);
-        close(sockfd);
-        return -1;
+        if (connect(sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) != 0)
+        {
+            printf("connect(%s:%s) failed.\n", argv[1], argv[2]);
+            close(sockfd);
+            return -1;
+        }
     }
 
     printf("connect ok.\n");
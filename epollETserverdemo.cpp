@@ -12,6 +12,9 @@
  * 
  * https://eklitzke.org/blocking-io-nonblocking-io-and-epoll
  * 
+ * Ctrl-C 退出时输出系统调用统计，和 epollserverdemo.cpp（LT、1024 字节缓冲区）对比：
+ * 这里缓冲区只有 5 字节，每个可读事件都要读很多次，最后还要多一次返回 EAGAIN 的 read 才知道读完了，
+ * read/event、eagain 比例和 syscalls/KB 都会明显更高。
  * */
 
 #include <stdio.h>
@@ -19,6 +22,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
@@ -27,8 +31,54 @@
 #include <sys/types.h>
 
 #define MAXEVENTS 1024
+// epoll_wait 批大小按 1,2,4,...,MAXEVENTS 分桶
+#define BATCHBUCKETS 11
+
+enum syscallid
+{
+    SC_EPOLL_WAIT,
+    SC_EPOLL_CTL,
+    SC_ACCEPT,
+    SC_READ,
+    SC_WRITE,
+    SC_CLOSE,
+    NSYSCALLS
+};
+
+struct syscallstats
+{
+    unsigned long long calls[NSYSCALLS];
+    unsigned long long eagain;          // read 返回 EAGAIN 的次数
+    unsigned long long readbytes;
+    unsigned long long readevents;      // 客户端 socket 上的可读事件数
+    unsigned long long events;          // epoll_wait 返回的事件总数
+    unsigned long long batches[BATCHBUCKETS];
+    unsigned long long fullbatches;     // 正好返回 MAXEVENTS 个事件的次数
+};
+
+static struct syscallstats syscalls;
+static volatile sig_atomic_t stop = 0;
+
+static void onsigint(int)
+{
+    stop = 1;
+}
+
+static void countbatch(int readyfds)
+{
+    if (readyfds <= 0)
+        return;
+    syscalls.events += readyfds;
+    int b = 0;
+    while (b < BATCHBUCKETS - 1 && (1 << b) < readyfds)
+        b++;
+    syscalls.batches[b]++;
+    if (readyfds == MAXEVENTS)
+        syscalls.fullbatches++;
+}
 
 int initserver(int port);
+void syscallreport();
 
 static void set_nonblocking(int fd) {
   int flags = fcntl(fd, F_GETFL, 0);
@@ -60,6 +110,18 @@ int main(int argc, char *argv[])
 
     set_nonblocking(listensock);
 
+    // 不设置 SA_RESTART，Ctrl-C 时 epoll_pwait 返回 EINTR，退出循环输出统计
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onsigint;
+    sigaction(SIGINT, &sa, NULL);
+
+    // SIGINT 平时被屏蔽，只在 epoll_pwait 里原子地放开，处理事件期间到达的 Ctrl-C 也不会被错过
+    sigset_t blocked, waitmask;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    sigprocmask(SIG_BLOCK, &blocked, &waitmask);
+
     // 创建一个新的 epoll 实例，返回对应的 fd，参数无用，大于0即可
     int epollfd = epoll_create(1);
 
@@ -107,11 +169,16 @@ int main(int argc, char *argv[])
          * 
          * 返回值：返回有事件发生的 fd 数量，0 表示 timeout 期间都没有事件发生，-1 error
          * */
-        int readyfds = epoll_wait(epollfd, events, MAXEVENTS, -1);
+        int readyfds = epoll_pwait(epollfd, events, MAXEVENTS, -1, &waitmask);
+        syscalls.calls[SC_EPOLL_WAIT]++;
+        countbatch(readyfds);
 
         if (readyfds == -1)
         {
-            perror("epoll() failed");
+            if (errno == EINTR && !stop)
+                continue;
+            if (!stop)
+                perror("epoll() failed");
             break;
         }
 
@@ -123,6 +190,7 @@ int main(int argc, char *argv[])
                 // error case
                 printf("epoll error\n");
                 close(events[i].data.fd);
+                syscalls.calls[SC_CLOSE]++;
                 continue;
             }
             // 新的客户端连接
@@ -142,6 +210,7 @@ int main(int argc, char *argv[])
 
                 // 从 pending 的连接队列中取出第一个给 listensock，创建一个新的已连接的 socket，并返回 fd
                 int clientsock = accept(listensock, (struct sockaddr *)&client, &len);
+                syscalls.calls[SC_ACCEPT]++;
 
                 if (clientsock < 0)
                 {
@@ -157,6 +226,7 @@ int main(int argc, char *argv[])
                 ev.data.fd = clientsock;
                 ev.events = EPOLLIN | EPOLLET;
                 epoll_ctl(epollfd, EPOLL_CTL_ADD, clientsock, &ev);
+                syscalls.calls[SC_EPOLL_CTL]++;
 
                 continue;    
             }
@@ -165,14 +235,17 @@ int main(int argc, char *argv[])
                 // 客户端有数据过来或客户端的socket连接被断开。
                 char buffer[5];
                 memset(buffer, 0, sizeof(buffer));
+                syscalls.readevents++;
 
                 for(;;) 
                 {
                     // 读取客户端的数据。
                     ssize_t isize = read(events[i].data.fd, buffer, sizeof(buffer));
+                    syscalls.calls[SC_READ]++;
 
                     if (isize == -1) {
                         if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                            syscalls.eagain++;
                             printf("finished reading data from client\n");
                             break;
                         } else {
@@ -182,12 +255,15 @@ int main(int argc, char *argv[])
                     } else if (isize == 0) {
                         printf("finished with %d\n", events[i].data.fd);
                         close(events[i].data.fd);
+                        syscalls.calls[SC_CLOSE]++;
                         break;
                     }
 
+                    syscalls.readbytes += isize;
                     printf("recv(eventfd=%d,size=%ld):%s\n", events[i].data.fd, isize, buffer);
                     // 把收到的报文发回给客户端。
                     write(events[i].data.fd, buffer, strlen(buffer));
+                    syscalls.calls[SC_WRITE]++;
                 }
             }
         }
@@ -196,9 +272,44 @@ int main(int argc, char *argv[])
     // 别忘了最后关闭 epollfd
     close(epollfd); 
 
+    syscallreport();
+
     return 0;
 }
 
+void syscallreport()
+{
+    static const char *names[NSYSCALLS] = {"epoll_wait", "epoll_ctl", "accept", "read", "write", "close"};
+
+    unsigned long long total = 0;
+    printf("\nsyscalls:");
+    for (int sc = 0; sc < NSYSCALLS; sc++)
+    {
+        printf(" %s=%llu", names[sc], syscalls.calls[sc]);
+        total += syscalls.calls[sc];
+    }
+    printf(" total=%llu\n", total);
+
+    unsigned long long reads = syscalls.calls[SC_READ];
+    unsigned long long waits = syscalls.calls[SC_EPOLL_WAIT];
+    printf("read/event=%.2f eagain=%.1f%% bytes/read=%.1f syscalls/KB=%.2f\n",
+           syscalls.readevents > 0 ? (double)reads / syscalls.readevents : 0.0,
+           reads > 0 ? 100.0 * syscalls.eagain / reads : 0.0,
+           reads > syscalls.eagain ? (double)syscalls.readbytes / (reads - syscalls.eagain) : 0.0,
+           syscalls.readbytes > 0 ? total * 1024.0 / syscalls.readbytes : 0.0);
+
+    unsigned long long batched = 0;
+    for (int b = 0; b < BATCHBUCKETS; b++)
+        batched += syscalls.batches[b];
+
+    printf("epoll_wait batch avg=%.2f (MAXEVENTS=%d, full=%llu, empty=%llu):",
+           batched > 0 ? (double)syscalls.events / batched : 0.0, MAXEVENTS, syscalls.fullbatches, waits - batched);
+    for (int b = 0; b < BATCHBUCKETS; b++)
+        if (syscalls.batches[b] > 0)
+            printf(" <=%d:%.1f%%", 1 << b, 100.0 * syscalls.batches[b] / batched);
+    printf("\n");
+}
+
 // 初始化服务端的监听端口。
 int initserver(int port)
 {
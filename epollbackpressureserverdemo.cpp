@@ -0,0 +1,332 @@
+/**
+ * 输出队列的高低水位线（背压）
+ *
+ * 前面的 echo 服务端读到数据就 write 回去。如果客户端只发不收，
+ * 对端的接收窗口和本机的 socket 发送缓冲区很快会被塞满：
+ * 阻塞 socket 会让 write 卡住整个事件循环；非阻塞 socket 写不完的部分就只能先存到用户态，
+ * 而只要继续读，用户态的待发送数据就会无限增长。
+ *
+ * 解决办法是把"写不出去"反馈到"不再读"：
+ * 1. 每个连接一个输出队列，write 返回 EAGAIN 时剩余数据留在队列里，同时关注 EPOLLOUT
+ * 2. 队列长度超过高水位线（HIGHWATER）时，从 epoll 中去掉 EPOLLIN，不再读这个连接
+ *    数据于是留在内核接收缓冲区里，TCP 流控会让客户端自己慢下来
+ * 3. EPOLLOUT 把队列写到不超过低水位线（LOWWATER）时，重新关注 EPOLLIN。低水位线为 0 就是等队列写空
+ *
+ * 高低两条线拉开距离是为了避免在临界点附近反复调用 epoll_ctl。
+ * 这样每个连接在用户态最多占用 HIGHWATER + 一次 read 的大小。
+ *
+ * 编译：g++ -std=c++17 -O2 -o epollbackpressureserverdemo epollbackpressureserverdemo.cpp
+ * */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/fcntl.h>
+#include <sys/types.h>
+#include <string>
+
+#define MAXEVENTS 1024
+#define MAXFDS 65536
+// 默认的高低水位线
+#define HIGHWATER (256 * 1024)
+#define LOWWATER (64 * 1024)
+
+int initserver(int port);
+
+static void set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags == -1) {
+    perror("fcntl()");
+    return;
+  }
+  if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    perror("fcntl()");
+  }
+}
+
+struct conn
+{
+    // 待发送的数据是 out[outpos, out.size())
+    std::string out;
+    size_t outpos;
+    // 当前向 epoll 注册的事件，只在变化时调用 epoll_ctl
+    uint32_t events;
+};
+
+static conn conns[MAXFDS];
+static int epollfd;
+static size_t highwater = HIGHWATER;
+static size_t lowwater = LOWWATER;
+
+static size_t pending(const conn *c)
+{
+    return c->out.size() - c->outpos;
+}
+
+static void watch(int fd, uint32_t events)
+{
+    conn *c = &conns[fd];
+    if (c->events == events)
+        return;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(struct epoll_event));
+    ev.data.fd = fd;
+    ev.events = events;
+    epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev);
+    c->events = events;
+}
+
+/**
+ * 尽量把输出队列写出去，返回 -1 表示连接出错
+ * */
+static int flush(int fd, conn *c)
+{
+    while (pending(c) > 0)
+    {
+        ssize_t n = write(fd, c->out.data() + c->outpos, pending(c));
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        c->outpos += n;
+    }
+
+    if (pending(c) == 0)
+    {
+        c->out.clear();
+        c->outpos = 0;
+    }
+    else if (c->outpos > c->out.size() / 2)
+    {
+        // 已发送的部分超过一半时才压缩，避免每次都 memmove
+        c->out.erase(0, c->outpos);
+        c->outpos = 0;
+    }
+    return 0;
+}
+
+/**
+ * 根据输出队列的长度决定关注哪些事件：
+ *   超过高水位线：只关注 EPOLLOUT，停止读
+ *   不超过低水位线：恢复 EPOLLIN（用 <=，低水位线为 0 时写空就恢复）
+ *   两者之间：保持原来的读状态不变
+ *   队列非空就需要 EPOLLOUT
+ * */
+static void update(int fd, conn *c)
+{
+    size_t n = pending(c);
+    bool reading = (c->events & EPOLLIN) != 0;
+
+    if (reading && n > highwater)
+    {
+        printf("client(eventfd=%d) pending=%zu above high watermark, pause reading.\n", fd, n);
+        reading = false;
+    }
+    else if (!reading && n <= lowwater)
+    {
+        printf("client(eventfd=%d) pending=%zu at or below low watermark, resume reading.\n", fd, n);
+        reading = true;
+    }
+
+    uint32_t events = 0;
+    if (reading)
+        events |= EPOLLIN;
+    if (n > 0)
+        events |= EPOLLOUT;
+    watch(fd, events);
+}
+
+static void closeconn(int fd)
+{
+    printf("client(eventfd=%d) disconnected.\n", fd);
+
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+
+    // 释放可能很大的输出队列
+    conn *c = &conns[fd];
+    std::string().swap(c->out);
+    c->outpos = 0;
+    c->events = 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2 && argc != 4)
+    {
+        printf("usage: ./epollbackpressureserverdemo port [highwater lowwater]\n");
+        return -1;
+    }
+
+    if (argc == 4)
+    {
+        highwater = atol(argv[2]);
+        lowwater = atol(argv[3]);
+        if (lowwater > highwater)
+        {
+            printf("lowwater must not exceed highwater.\n");
+            return -1;
+        }
+    }
+
+    // 用于监听的 socket
+    int listensock = initserver(atoi(argv[1]));
+    if (listensock < 0)
+    {
+        printf("initserver() failed.\n");
+        return -1;
+    }
+    printf("listensock=%d highwater=%zu lowwater=%zu\n", listensock, highwater, lowwater);
+
+    epollfd = epoll_create(1);
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(struct epoll_event));
+    ev.data.fd = listensock;
+    ev.events = EPOLLIN;
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, listensock, &ev);
+
+    while (1)
+    {
+        struct epoll_event events[MAXEVENTS];
+
+        int readyfds = epoll_wait(epollfd, events, MAXEVENTS, -1);
+        if (readyfds == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll() failed");
+            break;
+        }
+
+        for (int i = 0; i < readyfds; i++)
+        {
+            int fd = events[i].data.fd;
+
+            // 新的客户端连接
+            if (fd == listensock)
+            {
+                int clientsock = accept(listensock, NULL, NULL);
+                if (clientsock < 0)
+                {
+                    printf("accept() failed.\n");
+                    continue;
+                }
+                if (clientsock >= MAXFDS)
+                {
+                    close(clientsock);
+                    continue;
+                }
+
+                printf("client(socket=%d) connected ok.\n", clientsock);
+
+                set_nonblocking(clientsock);
+
+                memset(&ev, 0, sizeof(struct epoll_event));
+                ev.data.fd = clientsock;
+                ev.events = EPOLLIN;
+                epoll_ctl(epollfd, EPOLL_CTL_ADD, clientsock, &ev);
+                conns[clientsock].events = EPOLLIN;
+                continue;
+            }
+
+            conn *c = &conns[fd];
+
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
+            {
+                closeconn(fd);
+                continue;
+            }
+
+            if (events[i].events & EPOLLIN)
+            {
+                char buffer[16 * 1024];
+                ssize_t isize = read(fd, buffer, sizeof(buffer));
+                if (isize == 0 || (isize < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+                {
+                    closeconn(fd);
+                    continue;
+                }
+
+                if (isize > 0)
+                {
+                    // 队列为空时直接写，写不完的部分才进入队列
+                    size_t done = 0;
+                    if (pending(c) == 0)
+                    {
+                        ssize_t n = write(fd, buffer, isize);
+                        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+                        {
+                            closeconn(fd);
+                            continue;
+                        }
+                        if (n > 0)
+                            done = n;
+                    }
+                    c->out.append(buffer + done, isize - done);
+                }
+            }
+
+            if ((events[i].events & EPOLLOUT) && flush(fd, c) < 0)
+            {
+                closeconn(fd);
+                continue;
+            }
+
+            update(fd, c);
+        }
+    }
+
+    close(epollfd);
+
+    return 0;
+}
+
+// 初始化服务端的监听端口。
+int initserver(int port)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+    {
+        printf("socket() failed.\n");
+        return -1;
+    }
+
+    int opt = 1;
+    unsigned int len = sizeof(opt);
+
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, len);
+    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &opt, len);
+
+    struct sockaddr_in servaddr;
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    servaddr.sin_port = htons(port);
+
+    if (bind(sock, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0)
+    {
+        printf("bind() failed.\n");
+        close(sock);
+        return -1;
+    }
+
+    if (listen(sock, 5) != 0)
+    {
+        printf("listen() failed.\n");
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
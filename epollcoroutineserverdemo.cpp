@@ -0,0 +1,475 @@
+/**
+ * 用 C++20 协程把 epoll 的回调式写法变成"同步"写法
+ *
+ * epollserverdemo.cpp 里，业务逻辑被拆散在 epoll_wait 的循环里：读到多少、写没写完、下次从哪继续，
+ * 都要自己记在连接状态里，协议一复杂就很容易出错。
+ *
+ * 协程的思路是：
+ * 1. co_await async_read()/async_write()/async_accept() 时先直接尝试系统调用，能完成就不挂起
+ * 2. 返回 EAGAIN 时把"正在等待的操作"挂到 fd 对应的槽位上，协程挂起，回到 epoll 循环
+ * 3. epoll_wait 报告 fd 就绪后，由 reactor 代为完成这次读写，再 resume 协程
+ *
+ * 这样 handler 可以写成普通的 for 循环，而等待中的操作对象就放在协程帧里，不需要额外分配。
+ * 协程帧本身通过 promise_type 的 operator new 从内存池里取，连接断开后归还，
+ * 预热之后新建连接和每次 resume 都不会再走 malloc。
+ *
+ * 编译：g++ -std=c++20 -O2 -o epollcoroutineserverdemo epollcoroutineserverdemo.cpp
+ * */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/fcntl.h>
+#include <sys/types.h>
+#include <coroutine>
+#include <exception>
+
+#define MAXEVENTS 1024
+#define MAXFDS 65536
+// accept 因为 fd 或内存不足失败后，隔多久再试一次
+#define ACCEPTRETRYMS 100
+
+int initserver(int port);
+
+static void set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags == -1) {
+    perror("fcntl()");
+    return;
+  }
+  if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    perror("fcntl()");
+  }
+}
+
+/**
+ * 协程帧内存池
+ *
+ * 按 2 的幂分成若干档，每档一条空闲链表。帧释放时挂回链表，下次同样大小的协程直接复用。
+ * 超过最大一档的帧很少见，直接交给 malloc。
+ * */
+struct framepool
+{
+    static const int MINSHIFT = 6;   // 64 字节
+    static const int MAXSHIFT = 14;  // 16KB
+
+    struct freeblock { freeblock *next; };
+    static freeblock *freelists[MAXSHIFT + 1];
+
+    static int sizeclass(size_t n)
+    {
+        int shift = MINSHIFT;
+        while (((size_t)1 << shift) < n)
+            shift++;
+        return shift;
+    }
+
+    static void *allocate(size_t n)
+    {
+        int shift = sizeclass(n);
+        if (shift > MAXSHIFT)
+            return malloc(n);
+
+        freeblock *b = freelists[shift];
+        if (b != NULL)
+        {
+            freelists[shift] = b->next;
+            return b;
+        }
+        return malloc((size_t)1 << shift);
+    }
+
+    static void deallocate(void *p, size_t n)
+    {
+        int shift = sizeclass(n);
+        if (shift > MAXSHIFT)
+        {
+            free(p);
+            return;
+        }
+
+        freeblock *b = (freeblock *)p;
+        b->next = freelists[shift];
+        freelists[shift] = b;
+    }
+};
+
+framepool::freeblock *framepool::freelists[framepool::MAXSHIFT + 1];
+
+/**
+ * 最简单的"即发即忘"协程类型：创建后立即运行到第一个挂起点，结束时帧自动销毁。
+ * 连接的生命周期由协程自己管理，外部不需要持有 handle。
+ * */
+struct task
+{
+    struct promise_type
+    {
+        task get_return_object() { return task(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+
+        static void *operator new(size_t n) { return framepool::allocate(n); }
+        static void operator delete(void *p, size_t n) { framepool::deallocate(p, n); }
+    };
+};
+
+/**
+ * 一次挂起中的 IO 操作。
+ * complete() 尝试执行系统调用，返回 false 表示遇到了 EAGAIN，需要继续等待。
+ * */
+struct ioop
+{
+    std::coroutine_handle<> handle;
+    virtual bool complete() = 0;
+};
+
+// 每个 fd 一个槽位，分别记录等待读和等待写的操作
+struct ioslot
+{
+    ioop *reader;
+    ioop *writer;
+};
+
+static int epollfd;
+static ioslot slots[MAXFDS];
+// 因为资源不足挂起的 accept：监听 fd 和下次重试的时间，-1 表示没有
+static int retryfd = -1;
+static long long retryat;
+
+static long long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// 新 fd 以边缘触发方式注册一次，之后读写等待只修改槽位，不再调用 epoll_ctl
+static void reactor_add(int fd)
+{
+    set_nonblocking(fd);
+
+    slots[fd].reader = NULL;
+    slots[fd].writer = NULL;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(struct epoll_event));
+    ev.data.fd = fd;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void reactor_close(int fd)
+{
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL);
+    slots[fd].reader = NULL;
+    slots[fd].writer = NULL;
+    close(fd);
+}
+
+// 所有 awaiter 的公共部分：先尝试一次，EAGAIN 才挂到槽位上
+template <bool WRITE>
+struct ioawaiter : ioop
+{
+    int fd;
+
+    bool await_ready() { return complete(); }
+
+    void await_suspend(std::coroutine_handle<> h)
+    {
+        handle = h;
+        if (WRITE)
+            slots[fd].writer = this;
+        else
+            slots[fd].reader = this;
+    }
+};
+
+struct acceptawaiter : ioawaiter<false>
+{
+    int result;
+
+    /**
+     * EAGAIN 等下一次就绪；ECONNABORTED、EINTR 交给 acceptor 马上重试。
+     * 其他错误（EMFILE、ENFILE、ENOBUFS、ENOMEM 等）时监听 socket 一直可读，马上重试只会原地打转，
+     * 整个 reactor 都回不到 epoll_wait，所以同样挂起，由 reactor 在 ACCEPTRETRYMS 之后再试
+     * */
+    bool complete() override
+    {
+        result = accept(fd, NULL, NULL);
+        if (result >= 0)
+            return true;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return false;
+        if (errno == ECONNABORTED || errno == EINTR)
+            return true;
+
+        perror("accept()");
+        retryfd = fd;
+        retryat = now_ms() + ACCEPTRETRYMS;
+        return false;
+    }
+
+    int await_resume() { return result; }
+};
+
+struct readawaiter : ioawaiter<false>
+{
+    char *buf;
+    size_t len;
+    ssize_t result;
+
+    bool complete() override
+    {
+        result = read(fd, buf, len);
+        return !(result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+    }
+
+    ssize_t await_resume() { return result; }
+};
+
+// 写满 len 字节或出错才算完成，部分写入时记录进度继续等 EPOLLOUT
+struct writeawaiter : ioawaiter<true>
+{
+    const char *buf;
+    size_t len;
+    size_t done;
+    ssize_t result;
+
+    bool complete() override
+    {
+        while (done < len)
+        {
+            ssize_t n = write(fd, buf + done, len - done);
+            if (n < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return false;
+                result = -1;
+                return true;
+            }
+            done += n;
+        }
+        result = done;
+        return true;
+    }
+
+    ssize_t await_resume() { return result; }
+};
+
+static acceptawaiter async_accept(int listensock)
+{
+    acceptawaiter a;
+    a.fd = listensock;
+    return a;
+}
+
+static readawaiter async_read(int fd, char *buf, size_t len)
+{
+    readawaiter a;
+    a.fd = fd;
+    a.buf = buf;
+    a.len = len;
+    return a;
+}
+
+static writeawaiter async_write(int fd, const char *buf, size_t len)
+{
+    writeawaiter a;
+    a.fd = fd;
+    a.buf = buf;
+    a.len = len;
+    a.done = 0;
+    return a;
+}
+
+// 连接处理逻辑：看起来就是阻塞 IO 的写法
+static task handle_client(int clientsock)
+{
+    char buffer[1024];
+
+    for (;;)
+    {
+        ssize_t isize = co_await async_read(clientsock, buffer, sizeof(buffer));
+        // 发生了错误或socket被对方关闭。
+        if (isize <= 0)
+        {
+            printf("client(socket=%d) disconnected.\n", clientsock);
+            break;
+        }
+
+        printf("recv(socket=%d,size=%ld):%.*s\n", clientsock, isize, (int)isize, buffer);
+
+        // 把收到的报文发回给客户端，按实际读到的长度而不是 strlen
+        if (co_await async_write(clientsock, buffer, isize) < 0)
+        {
+            perror("write()");
+            break;
+        }
+    }
+
+    reactor_close(clientsock);
+}
+
+static task acceptor(int listensock)
+{
+    for (;;)
+    {
+        int clientsock = co_await async_accept(listensock);
+        if (clientsock < 0)
+        {
+            printf("accept() failed.\n");
+            continue;
+        }
+        if (clientsock >= MAXFDS)
+        {
+            printf("too many clients.\n");
+            close(clientsock);
+            continue;
+        }
+
+        printf("client(socket=%d) connected ok.\n", clientsock);
+
+        reactor_add(clientsock);
+        // 协程立即运行到第一次 co_await，随后返回这里继续 accept
+        handle_client(clientsock);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        printf("usage: ./epollcoroutineserverdemo port\n");
+        return -1;
+    }
+
+    // 用于监听的 socket
+    int listensock = initserver(atoi(argv[1]));
+    if (listensock < 0)
+    {
+        printf("initserver() failed.\n");
+        return -1;
+    }
+    printf("listensock=%d\n", listensock);
+
+    epollfd = epoll_create(1);
+
+    reactor_add(listensock);
+    acceptor(listensock);
+
+    while (1)
+    {
+        struct epoll_event events[MAXEVENTS];
+
+        int timeout = -1;
+        if (retryfd >= 0)
+        {
+            long long left = retryat - now_ms();
+            timeout = left > 0 ? (int)left : 0;
+        }
+
+        int readyfds = epoll_wait(epollfd, events, MAXEVENTS, timeout);
+        if (readyfds == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll() failed");
+            break;
+        }
+
+        for (int i = 0; i < readyfds; i++)
+        {
+            int fd = events[i].data.fd;
+            ioslot *slot = &slots[fd];
+
+            // 出错或对端关闭时也要唤醒等待者，让它自己从系统调用的返回值里看到错误
+            if ((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) && slot->reader != NULL)
+            {
+                ioop *op = slot->reader;
+                if (op->complete())
+                {
+                    slot->reader = NULL;
+                    op->handle.resume();
+                }
+            }
+
+            // 上面的 resume 里连接可能已经被关闭，此时槽位已被清空
+            if ((events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) && slot->writer != NULL)
+            {
+                ioop *op = slot->writer;
+                if (op->complete())
+                {
+                    slot->writer = NULL;
+                    op->handle.resume();
+                }
+            }
+        }
+
+        // 到时间了，重试因资源不足挂起的 accept；监听 socket 是边缘触发，不能指望它再报告就绪
+        if (retryfd >= 0 && now_ms() >= retryat)
+        {
+            ioslot *slot = &slots[retryfd];
+            retryfd = -1;
+            if (slot->reader != NULL)
+            {
+                ioop *op = slot->reader;
+                if (op->complete())
+                {
+                    slot->reader = NULL;
+                    op->handle.resume();
+                }
+            }
+        }
+    }
+
+    close(epollfd);
+
+    return 0;
+}
+
+// 初始化服务端的监听端口。
+int initserver(int port)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+    {
+        printf("socket() failed.\n");
+        return -1;
+    }
+
+    int opt = 1;
+    unsigned int len = sizeof(opt);
+
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, len);
+    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &opt, len);
+
+    struct sockaddr_in servaddr;
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    servaddr.sin_port = htons(port);
+
+    if (bind(sock, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0)
+    {
+        printf("bind() failed.\n");
+        close(sock);
+        return -1;
+    }
+
+    if (listen(sock, 5) != 0)
+    {
+        printf("listen() failed.\n");
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
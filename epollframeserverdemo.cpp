@@ -0,0 +1,461 @@
+/**
+ * 长度前缀分帧 + 零拷贝消息视图
+ *
+ * TCP 是字节流，没有"消息"的概念：一次 read() 可能只读到半条消息，也可能一次读到好几条。
+ * 前面几个 demo 把 read() 的结果直接当作一条消息，还用 strlen() 求长度，遇到二进制数据（含 '\0'）就错了。
+ *
+ * 这里每条消息（帧）前面加 4 字节大端序的长度：
+ *
+ *     +----------------+---------------------+
+ *     | length (4字节)  | payload (length字节) |
+ *     +----------------+---------------------+
+ *
+ * 每个连接有一块输入缓冲区，read() 追加到末尾，解析器直接在缓冲区里找完整的帧，
+ * 交给 handler 的是指向缓冲区内部的 frameview（指针 + 长度），完整的帧不做任何拷贝。
+ *
+ * 输入缓冲区是一个"镜像"环形缓冲区：同一块 memfd 内存在虚拟地址上连续映射两次，
+ *
+ *     虚拟地址  buf                    buf + cap                buf + 2 * cap
+ *               | memfd [0, cap)       | 同一个 memfd [0, cap)   |
+ *
+ * 写到 buf + cap + i 的字节从 buf + i 也能读到。数据在环里绕过末尾时，从 buf + rpos 开始
+ * 仍然是连续的 wpos - rpos 个字节，read() 和解析器都只看到一段连续内存，
+ * 不用再把半帧 memmove 到缓冲区开头。大流量下读到的数据跨过末尾是常态，省掉的就是这部分拷贝。
+ *
+ * 回显时 handler 产生的回复也以 iovec 的形式直接引用输入缓冲区，同一次 read 解析出的所有帧
+ * 用一次 writev() 发出去。
+ *
+ * 连接的输入缓冲区只在第一次 accept 到这个 fd 时分配一次，之后一直复用，除了超过 INBUFSIZE 的大帧，稳态收发不做任何堆分配。
+ * 用 -DALLOC_HOOKS 编译可以验证这一点：Ctrl-C 退出时输出每轮事件循环的分配统计，见 allochooks.h 和 bench.sh。
+ *
+ * 编译：g++ -O2 -o epollframeserverdemo epollframeserverdemo.cpp
+ * 客户端：frameclient.cpp
+ * */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/fcntl.h>
+#include <sys/types.h>
+#include "allochooks.h"
+
+#define MAXEVENTS 1024
+#define MAXFDS 65536
+// 帧头长度
+#define FRAMEHDR 4
+// 单帧最大长度，超过视为协议错误
+#define MAXFRAME (16 * 1024 * 1024)
+// 输入缓冲区的初始大小，必须是页大小的整数倍
+#define INBUFSIZE (64 * 1024)
+// 一次 writev 最多携带的帧数
+#define MAXBATCH 64
+
+int initserver(int port);
+
+// 指向输入缓冲区内部的一条消息，只在本次解析期间有效
+struct frameview
+{
+    const char *data;
+    uint32_t len;
+};
+
+// 每个连接的输入缓冲区：[rpos, wpos) 是已读入但尚未解析的数据，rpos < cap，wpos - rpos <= cap
+struct conn
+{
+    char *buf;      // 镜像映射的起始地址，共 2 * cap 字节的虚拟地址
+    size_t cap;
+    size_t rpos;
+    size_t wpos;
+};
+
+static struct conn conns[MAXFDS];
+static volatile sig_atomic_t stop = 0;
+
+static void onsigint(int)
+{
+    stop = 1;
+}
+
+/**
+ * 分配一个 cap 字节的镜像环形缓冲区，cap 必须是页大小的整数倍。
+ * 先占住 2 * cap 的地址空间，再把同一个 memfd 用 MAP_FIXED 映射到前后两半。失败返回 NULL
+ * */
+static char *ringalloc(size_t cap)
+{
+    int fd = memfd_create("framebuf", MFD_CLOEXEC);
+    if (fd < 0)
+    {
+        perror("memfd_create()");
+        return NULL;
+    }
+    if (ftruncate(fd, cap) != 0)
+    {
+        perror("ftruncate()");
+        close(fd);
+        return NULL;
+    }
+
+    char *base = (char *)mmap(NULL, 2 * cap, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+    {
+        perror("mmap()");
+        close(fd);
+        return NULL;
+    }
+
+    if (mmap(base, cap, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(base + cap, cap, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        perror("mmap()");
+        munmap(base, 2 * cap);
+        close(fd);
+        return NULL;
+    }
+
+    // 映射持有 memfd 的引用，fd 本身不再需要
+    close(fd);
+    return base;
+}
+
+static void ringfree(char *buf, size_t cap)
+{
+    munmap(buf, 2 * cap);
+}
+
+// 一批待发送的回复，帧头放在 hdrs 里，payload 直接引用输入缓冲区
+struct replybatch
+{
+    struct iovec iov[MAXBATCH * 2];
+    uint32_t hdrs[MAXBATCH];
+    int nframes;
+    size_t bytes;
+};
+
+static void reply(struct replybatch *batch, struct frameview frame)
+{
+    int k = batch->nframes++;
+    batch->hdrs[k] = htonl(frame.len);
+    batch->iov[2 * k].iov_base = &batch->hdrs[k];
+    batch->iov[2 * k].iov_len = FRAMEHDR;
+    batch->iov[2 * k + 1].iov_base = (void *)frame.data;
+    batch->iov[2 * k + 1].iov_len = frame.len;
+    batch->bytes += FRAMEHDR + frame.len;
+}
+
+// 阻塞地把一批回复全部写出去，处理 writev 只写了一部分的情况
+static int flush(int fd, struct replybatch *batch)
+{
+    struct iovec *iov = batch->iov;
+    int iovcnt = batch->nframes * 2;
+
+    while (iovcnt > 0)
+    {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    batch->nframes = 0;
+    batch->bytes = 0;
+    return 0;
+}
+
+// 业务逻辑：原样回显
+static void handle(struct replybatch *batch, struct frameview frame)
+{
+    reply(batch, frame);
+}
+
+/**
+ * 从输入缓冲区中解析出所有完整的帧并处理。
+ * 返回 -1 表示协议错误，连接应被关闭。
+ * */
+static int parse(int fd, struct conn *c)
+{
+    struct replybatch batch;
+    batch.nframes = 0;
+    batch.bytes = 0;
+
+    while (c->wpos - c->rpos >= FRAMEHDR)
+    {
+        uint32_t len;
+        memcpy(&len, c->buf + c->rpos, FRAMEHDR);
+        len = ntohl(len);
+
+        if (len > MAXFRAME)
+        {
+            printf("client(eventfd=%d) frame too large: %u\n", fd, len);
+            return -1;
+        }
+
+        // 半帧，等下一次 read
+        if (c->wpos - c->rpos - FRAMEHDR < len)
+            break;
+
+        struct frameview frame;
+        frame.data = c->buf + c->rpos + FRAMEHDR;
+        frame.len = len;
+        handle(&batch, frame);
+
+        // rpos 走到镜像的后一半时换回前一半的同一位置
+        c->rpos += FRAMEHDR + len;
+        if (c->rpos >= c->cap)
+        {
+            c->rpos -= c->cap;
+            c->wpos -= c->cap;
+        }
+
+        if (batch.nframes == MAXBATCH && flush(fd, &batch) < 0)
+            return -1;
+    }
+
+    // 回复引用着输入缓冲区，必须在后面的 read 覆盖这部分数据之前发出去
+    if (batch.nframes > 0 && flush(fd, &batch) < 0)
+        return -1;
+
+    if (c->rpos == c->wpos)
+    {
+        c->rpos = 0;
+        c->wpos = 0;
+        return 0;
+    }
+
+    // 剩下一个不完整的帧：环形缓冲区里放得下就原地等，绕过末尾也没关系，只有帧比整个环还大才扩容
+    size_t need = FRAMEHDR;
+    if (c->wpos - c->rpos >= FRAMEHDR)
+    {
+        uint32_t len;
+        memcpy(&len, c->buf + c->rpos, FRAMEHDR);
+        need += ntohl(len);
+    }
+
+    if (need > c->cap)
+    {
+        size_t cap = c->cap;
+        while (cap < need)
+            cap *= 2;
+
+        char *nbuf = ringalloc(cap);
+        if (nbuf == NULL)
+            return -1;
+
+        size_t pending = c->wpos - c->rpos;
+        memcpy(nbuf, c->buf + c->rpos, pending);
+        ringfree(c->buf, c->cap);
+        c->buf = nbuf;
+        c->cap = cap;
+        c->rpos = 0;
+        c->wpos = pending;
+    }
+
+    return 0;
+}
+
+static void closeconn(int epollfd, int fd)
+{
+    printf("client(eventfd=%d) disconnected.\n", fd);
+
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+
+    // 大帧扩容出来的缓冲区不保留，回到初始大小
+    if (conns[fd].buf != NULL && conns[fd].cap != INBUFSIZE)
+    {
+        ringfree(conns[fd].buf, conns[fd].cap);
+        conns[fd].buf = NULL;
+    }
+    conns[fd].rpos = 0;
+    conns[fd].wpos = 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        printf("usage: ./epollframeserverdemo port\n");
+        return -1;
+    }
+
+    // 用于监听的 socket
+    int listensock = initserver(atoi(argv[1]));
+    if (listensock < 0)
+    {
+        printf("initserver() failed.\n");
+        return -1;
+    }
+    printf("listensock=%d\n", listensock);
+
+    allocinit();
+
+    // 不设置 SA_RESTART，Ctrl-C 时 epoll_wait 返回 EINTR，退出循环
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onsigint;
+    sigaction(SIGINT, &sa, NULL);
+
+    // SIGINT 平时被屏蔽，只在 epoll_pwait 里原子地放开，处理事件期间到达的 Ctrl-C 也不会被错过
+    sigset_t blocked, waitmask;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    sigprocmask(SIG_BLOCK, &blocked, &waitmask);
+
+    int epollfd = epoll_create(1);
+
+    struct epoll_event ev;
+    ev.data.fd = listensock;
+    ev.events = EPOLLIN;
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, listensock, &ev);
+
+    while (1)
+    {
+        struct epoll_event events[MAXEVENTS];
+
+        int readyfds = epoll_pwait(epollfd, events, MAXEVENTS, -1, &waitmask);
+        if (readyfds == -1)
+        {
+            if (errno == EINTR && !stop)
+                continue;
+            if (!stop)
+                perror("epoll() failed");
+            break;
+        }
+        allocbegin();
+
+        for (int i = 0; i < readyfds; i++)
+        {
+            int fd = events[i].data.fd;
+
+            // 新的客户端连接
+            if (fd == listensock)
+            {
+                allocchurn();
+                int clientsock = accept(listensock, NULL, NULL);
+                if (clientsock < 0)
+                {
+                    printf("accept() failed.\n");
+                    continue;
+                }
+                if (clientsock >= MAXFDS)
+                {
+                    close(clientsock);
+                    continue;
+                }
+
+                printf("client(socket=%d) connected ok.\n", clientsock);
+
+                struct conn *c = &conns[clientsock];
+                if (c->buf == NULL)
+                {
+                    c->buf = ringalloc(INBUFSIZE);
+                    if (c->buf == NULL)
+                    {
+                        close(clientsock);
+                        continue;
+                    }
+                    c->cap = INBUFSIZE;
+                }
+                c->rpos = 0;
+                c->wpos = 0;
+
+                memset(&ev, 0, sizeof(struct epoll_event));
+                ev.data.fd = clientsock;
+                ev.events = EPOLLIN;
+                epoll_ctl(epollfd, EPOLL_CTL_ADD, clientsock, &ev);
+                continue;
+            }
+
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
+            {
+                allocchurn();
+                closeconn(epollfd, fd);
+                continue;
+            }
+
+            // 直接读进环形缓冲区的空闲部分，镜像映射保证 [wpos, rpos + cap) 是连续的
+            struct conn *c = &conns[fd];
+            ssize_t isize = read(fd, c->buf + c->wpos, c->cap - (c->wpos - c->rpos));
+            if (isize <= 0)
+            {
+                allocchurn();
+                closeconn(epollfd, fd);
+                continue;
+            }
+            c->wpos += isize;
+
+            if (parse(fd, c) < 0)
+            {
+                allocchurn();
+                closeconn(epollfd, fd);
+            }
+        }
+        allocend();
+    }
+
+    close(epollfd);
+
+    return allocreport();
+}
+
+// 初始化服务端的监听端口。
+int initserver(int port)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+    {
+        printf("socket() failed.\n");
+        return -1;
+    }
+
+    int opt = 1;
+    unsigned int len = sizeof(opt);
+
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, len);
+    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &opt, len);
+
+    struct sockaddr_in servaddr;
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    servaddr.sin_port = htons(port);
+
+    if (bind(sock, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0)
+    {
+        printf("bind() failed.\n");
+        close(sock);
+        return -1;
+    }
+
+    if (listen(sock, 5) != 0)
+    {
+        printf("listen() failed.\n");
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
@@ -0,0 +1,549 @@
+/**
+ * 零停机重启：通过 Unix socket 的 SCM_RIGHTS 把监听 socket 和客户端连接交给新进程
+ *
+ * 普通的重启是先停老进程再起新进程：中间这段时间端口没人监听，新连接被拒绝（RST），
+ * 老进程上的连接全部断开，所有客户端同时重连，新进程又是冷启动，延迟会出现一个尖峰。
+ *
+ * fd 可以通过 Unix domain socket 的辅助数据（SCM_RIGHTS）在进程间传递，
+ * 接收方拿到的是指向同一个内核 socket 对象的新 fd，就像 dup() 一样。于是：
+ *
+ * 1. 每个进程除了 TCP 监听端口，还在 ctlpath 上监听一个 Unix socket 作为控制通道
+ * 2. 新进程启动时先尝试连接 ctlpath，连上了说明有老进程在跑，进入接管流程：
+ *      老进程  -> 新进程   LISTENER 消息 + 监听 socket 的 fd
+ *      老进程  -> 新进程   每个连接一条 CLIENT 消息 + 客户端 fd + 尚未发出去的数据
+ *      老进程  -> 新进程   DONE
+ *      新进程  -> 老进程   ACK（新进程已经在 ctlpath 上监听好了，可以接受下一次接管）
+ *    新进程的控制 socket 先绑在临时路径上，收齐 fd 之后才 rename() 到 ctlpath，
+ *    接管中途失败时 ctlpath 仍然属于老进程
+ *    老进程收到 ACK 后退出
+ * 3. 连不上说明是第一次启动，正常 bind + listen
+ *
+ * 监听 socket 从头到尾都没有关闭过，接管期间到达的连接在 accept 队列里等新进程来取；
+ * 客户端连接也原样保留，对客户端完全透明。
+ *
+ * 编译：g++ -std=c++17 -O2 -o epollhandoffserverdemo epollhandoffserverdemo.cpp
+ * 示例：./epollhandoffserverdemo 5005 /tmp/echo.ctl      # 第一次启动
+ *      ./epollhandoffserverdemo 5005 /tmp/echo.ctl      # 再执行一次即可接管，老进程自动退出
+ * */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/fcntl.h>
+#include <sys/types.h>
+#include <string>
+
+#define MAXEVENTS 1024
+#define MAXFDS 65536
+
+int initserver(int port);
+
+static void set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags == -1) {
+    perror("fcntl()");
+    return;
+  }
+  if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    perror("fcntl()");
+  }
+}
+
+// 控制通道上的消息类型
+enum
+{
+    MSG_LISTENER = 1,
+    MSG_CLIENT,
+    MSG_DONE,
+    MSG_ACK,
+};
+
+// 消息头，fd（如果有）作为辅助数据附在消息头上，len 字节的数据紧跟其后
+struct msghdr_t
+{
+    uint32_t type;
+    uint32_t len;
+};
+
+struct conn
+{
+    bool active;
+    // 写不出去的回显数据，接管时随连接一起交给新进程
+    std::string out;
+};
+
+static conn conns[MAXFDS];
+static int epollfd;
+
+static int readn(int fd, char *buf, size_t n)
+{
+    while (n > 0)
+    {
+        ssize_t r = read(fd, buf, n);
+        if (r <= 0)
+        {
+            if (r < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += r;
+        n -= r;
+    }
+    return 0;
+}
+
+static int writen(int fd, const char *buf, size_t n)
+{
+    while (n > 0)
+    {
+        ssize_t w = write(fd, buf, n);
+        if (w <= 0)
+        {
+            if (w < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += w;
+        n -= w;
+    }
+    return 0;
+}
+
+/**
+ * 发送一条控制消息，passfd >= 0 时通过 SCM_RIGHTS 附带这个 fd
+ * */
+static int sendmessage(int ctl, uint32_t type, int passfd, const char *data, uint32_t len)
+{
+    struct msghdr_t hdr;
+    hdr.type = type;
+    hdr.len = len;
+
+    struct iovec iov;
+    iov.iov_base = &hdr;
+    iov.iov_len = sizeof(hdr);
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    // 辅助数据缓冲区，CMSG_SPACE 包含了对齐需要的填充
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    if (passfd >= 0)
+    {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &passfd, sizeof(int));
+    }
+
+    if (sendmsg(ctl, &msg, 0) != sizeof(hdr))
+        return -1;
+
+    return writen(ctl, data, len);
+}
+
+/**
+ * 接收一条控制消息的消息头和附带的 fd（没有时为 -1），数据部分由调用者接着读
+ * */
+static int recvmessage(int ctl, struct msghdr_t *hdr, int *passfd)
+{
+    struct iovec iov;
+    iov.iov_base = hdr;
+    iov.iov_len = sizeof(*hdr);
+
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    // MSG_CMSG_CLOEXEC：收到的 fd 不要泄漏给以后 exec 的子进程
+    ssize_t n = recvmsg(ctl, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    if (n != sizeof(*hdr))
+        return -1;
+
+    *passfd = -1;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        memcpy(passfd, CMSG_DATA(cmsg), sizeof(int));
+
+    return 0;
+}
+
+static void watch(int fd, int op)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(struct epoll_event));
+    ev.data.fd = fd;
+    ev.events = EPOLLIN;
+    if (fd < MAXFDS && !conns[fd].out.empty())
+        ev.events |= EPOLLOUT;
+    epoll_ctl(epollfd, op, fd, &ev);
+}
+
+static void addclient(int fd)
+{
+    set_nonblocking(fd);
+    conns[fd].active = true;
+    watch(fd, EPOLL_CTL_ADD);
+}
+
+static void closeconn(int fd)
+{
+    printf("client(eventfd=%d) disconnected.\n", fd);
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+    conns[fd].active = false;
+    conns[fd].out.clear();
+}
+
+/**
+ * 在 ctlpath 上监听控制通道。
+ * 先绑定到临时路径 ctlpath.pid 并 listen，再 rename() 覆盖 ctlpath。rename 是原子的，
+ * ctlpath 要么还指向老进程，要么已经指向一个在 listen 的新进程；新进程在这之前失败的话，
+ * 老进程的控制通道原封不动，之后还能被再次接管。ctlpath 上异常退出留下的旧文件也一并被覆盖
+ * */
+static int initcontrol(const char *path)
+{
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return -1;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    int n = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s.%d", path, (int)getpid());
+    if (n < 0 || (size_t)n >= sizeof(addr.sun_path))
+    {
+        close(sock);
+        return -1;
+    }
+
+    unlink(addr.sun_path);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 1) != 0 ||
+        rename(addr.sun_path, path) != 0)
+    {
+        unlink(addr.sun_path);
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/**
+ * 尝试从老进程接管。返回接管到的监听 socket；没有老进程时返回 -1
+ * */
+static int takeover(const char *path, int *ctl)
+{
+    *ctl = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    if (connect(*ctl, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        close(*ctl);
+        *ctl = -1;
+        return -1;
+    }
+
+    int listensock = -1;
+    int nclients = 0;
+
+    for (;;)
+    {
+        struct msghdr_t hdr;
+        int fd;
+        if (recvmessage(*ctl, &hdr, &fd) != 0)
+        {
+            printf("handoff interrupted.\n");
+            exit(1);
+        }
+
+        if (hdr.type == MSG_DONE)
+            break;
+
+        std::string data(hdr.len, '\0');
+        if (readn(*ctl, &data[0], hdr.len) != 0)
+        {
+            printf("handoff interrupted.\n");
+            exit(1);
+        }
+
+        if (hdr.type == MSG_LISTENER)
+        {
+            listensock = fd;
+        }
+        else if (hdr.type == MSG_CLIENT && fd >= 0 && fd < MAXFDS)
+        {
+            conns[fd].out = std::move(data);
+            addclient(fd);
+            nclients++;
+        }
+        else if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+
+    printf("took over listensock=%d and %d clients.\n", listensock, nclients);
+    return listensock;
+}
+
+/**
+ * 老进程：把监听 socket 和所有连接交给新进程，收到 ACK 后退出
+ * */
+static void handoff(int ctl, int listensock)
+{
+    // 控制通道用阻塞模式，接管期间不再处理任何连接上的事件
+    int flags = fcntl(ctl, F_GETFL, 0);
+    fcntl(ctl, F_SETFL, flags & ~O_NONBLOCK);
+
+    int nclients = 0;
+    if (sendmessage(ctl, MSG_LISTENER, listensock, NULL, 0) != 0)
+        goto failed;
+
+    for (int fd = 0; fd < MAXFDS; fd++)
+    {
+        if (!conns[fd].active)
+            continue;
+        if (sendmessage(ctl, MSG_CLIENT, fd, conns[fd].out.data(), conns[fd].out.size()) != 0)
+            goto failed;
+        nclients++;
+    }
+
+    if (sendmessage(ctl, MSG_DONE, -1, NULL, 0) != 0)
+        goto failed;
+
+    struct msghdr_t hdr;
+    int fd;
+    if (recvmessage(ctl, &hdr, &fd) != 0 || hdr.type != MSG_ACK)
+        goto failed;
+
+    printf("handed off listensock and %d clients, exiting.\n", nclients);
+    exit(0);
+
+failed:
+    // 新进程半路出错，继续由老进程服务
+    printf("handoff failed, keep serving.\n");
+    close(ctl);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        printf("usage: ./epollhandoffserverdemo port ctlpath\n");
+        return -1;
+    }
+
+    epollfd = epoll_create1(EPOLL_CLOEXEC);
+
+    int ctl;
+    int listensock = takeover(argv[2], &ctl);
+    if (listensock < 0)
+    {
+        // 没有老进程，正常启动
+        listensock = initserver(atoi(argv[1]));
+        if (listensock < 0)
+        {
+            printf("initserver() failed.\n");
+            return -1;
+        }
+    }
+    printf("listensock=%d\n", listensock);
+
+    int ctlsock = initcontrol(argv[2]);
+    if (ctlsock < 0)
+    {
+        printf("initcontrol(%s) failed.\n", argv[2]);
+        return -1;
+    }
+
+    // 控制通道准备好之后才让老进程退出，保证任何时刻都有进程可以被接管
+    if (ctl >= 0)
+    {
+        sendmessage(ctl, MSG_ACK, -1, NULL, 0);
+        close(ctl);
+    }
+
+    watch(listensock, EPOLL_CTL_ADD);
+    watch(ctlsock, EPOLL_CTL_ADD);
+
+    while (1)
+    {
+        struct epoll_event events[MAXEVENTS];
+
+        int readyfds = epoll_wait(epollfd, events, MAXEVENTS, -1);
+        if (readyfds == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll() failed");
+            break;
+        }
+
+        for (int i = 0; i < readyfds; i++)
+        {
+            int fd = events[i].data.fd;
+
+            // 新进程来接管
+            if (fd == ctlsock)
+            {
+                int newctl = accept(ctlsock, NULL, NULL);
+                if (newctl >= 0)
+                    handoff(newctl, listensock);
+                // 接管失败才会回到这里，本轮剩下的事件可能已经过期，重新 epoll_wait
+                break;
+            }
+
+            // 新的客户端连接
+            if (fd == listensock)
+            {
+                int clientsock = accept(listensock, NULL, NULL);
+                if (clientsock < 0)
+                {
+                    printf("accept() failed.\n");
+                    continue;
+                }
+                if (clientsock >= MAXFDS)
+                {
+                    close(clientsock);
+                    continue;
+                }
+
+                printf("client(socket=%d) connected ok.\n", clientsock);
+                addclient(clientsock);
+                continue;
+            }
+
+            conn *c = &conns[fd];
+
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
+            {
+                closeconn(fd);
+                continue;
+            }
+
+            // 上次没写完的数据
+            if (events[i].events & EPOLLOUT)
+            {
+                ssize_t n = write(fd, c->out.data(), c->out.size());
+                if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+                {
+                    closeconn(fd);
+                    continue;
+                }
+                if (n > 0)
+                    c->out.erase(0, n);
+                if (c->out.empty())
+                    watch(fd, EPOLL_CTL_MOD);
+            }
+
+            if (!(events[i].events & EPOLLIN))
+                continue;
+
+            char buffer[1024];
+            ssize_t isize = read(fd, buffer, sizeof(buffer));
+            if (isize <= 0)
+            {
+                if (isize < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    continue;
+                closeconn(fd);
+                continue;
+            }
+
+            printf("recv(eventfd=%d,size=%ld):%.*s\n", fd, isize, (int)isize, buffer);
+
+            // 把收到的报文发回给客户端，写不完的部分留到 EPOLLOUT
+            size_t done = 0;
+            if (c->out.empty())
+            {
+                ssize_t n = write(fd, buffer, isize);
+                if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+                {
+                    closeconn(fd);
+                    continue;
+                }
+                if (n > 0)
+                    done = n;
+            }
+            if (done < (size_t)isize)
+            {
+                bool wasempty = c->out.empty();
+                c->out.append(buffer + done, isize - done);
+                if (wasempty)
+                    watch(fd, EPOLL_CTL_MOD);
+            }
+        }
+    }
+
+    close(epollfd);
+
+    return 0;
+}
+
+// 初始化服务端的监听端口。
+int initserver(int port)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+    {
+        printf("socket() failed.\n");
+        return -1;
+    }
+
+    int opt = 1;
+    unsigned int len = sizeof(opt);
+
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, len);
+    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &opt, len);
+
+    struct sockaddr_in servaddr;
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    servaddr.sin_port = htons(port);
+
+    if (bind(sock, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0)
+    {
+        printf("bind() failed.\n");
+        close(sock);
+        return -1;
+    }
+
+    if (listen(sock, 5) != 0)
+    {
+        printf("listen() failed.\n");
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
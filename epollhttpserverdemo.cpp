@@ -0,0 +1,555 @@
+/**
+ * epoll 上的极简 HTTP/1.1 服务端：keep-alive + pipelining + SIMD 报文头扫描
+ *
+ * HTTP/1.1 默认长连接，一个连接上可以先后（甚至不等回复连续地）发多个请求。
+ * 和 epollrespserverdemo.cpp 一样，每次 read 之后解析出所有完整的请求，回复追加到输出缓冲区，整批只 write 一次。
+ *
+ * 解析 HTTP 报文头的大部分时间花在逐字节找分隔符（空格、':'、"\r\n"）上。
+ * 这里用 SSE2（编译时打开 -mavx2 则用 AVX2）一次比较 16/32 个字节：
+ *     _mm_cmpeq_epi8 得到每个字节是否等于目标字符，_mm_movemask_epi8 压成一个整数位图，
+ *     __builtin_ctz 找到第一个置位的位置就是分隔符的偏移
+ * 不足一个向量宽度的尾部才退回逐字节比较。
+ *
+ * 接口：
+ *     GET  /health    返回 "ok"
+ *     GET  /metrics   返回请求数、连接数、字节数等计数
+ *     POST /echo      原样返回请求体（需要 Content-Length，不支持 chunked）
+ *
+ * 和裸 echo 对比每秒请求数，例如：
+ *     wrk -t1 -c50 -d10s http://127.0.0.1:8080/health
+ *     wrk -t1 -c50 -d10s -s pipeline.lua http://127.0.0.1:8080/health   （wrk 的流水线脚本）
+ *
+ * 编译：g++ -std=c++17 -O2 -o epollhttpserverdemo epollhttpserverdemo.cpp
+ *      g++ -std=c++17 -O2 -mavx2 -o epollhttpserverdemo epollhttpserverdemo.cpp
+ * */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/fcntl.h>
+#include <sys/types.h>
+#include <string>
+#include <emmintrin.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#define MAXEVENTS 1024
+#define MAXFDS 65536
+// 输入缓冲区的初始大小
+#define INBUFSIZE (16 * 1024)
+// 报文头和请求体的上限
+#define MAXHEADER (64 * 1024)
+#define MAXBODY (16 * 1024 * 1024)
+
+int initserver(int port);
+
+static void set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags == -1) {
+    perror("fcntl()");
+    return;
+  }
+  if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    perror("fcntl()");
+  }
+}
+
+/**
+ * 在 [p, end) 中找第一个等于 a 或 b 的字节，找不到返回 end
+ * */
+static const char *scan2(const char *p, const char *end, char a, char b)
+{
+#ifdef __AVX2__
+    const __m256i va32 = _mm256_set1_epi8(a);
+    const __m256i vb32 = _mm256_set1_epi8(b);
+    while (end - p >= 32)
+    {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)p);
+        __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, va32), _mm256_cmpeq_epi8(chunk, vb32));
+        unsigned int mask = _mm256_movemask_epi8(hit);
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+        p += 32;
+    }
+#endif
+    const __m128i va = _mm_set1_epi8(a);
+    const __m128i vb = _mm_set1_epi8(b);
+    while (end - p >= 16)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(chunk, va), _mm_cmpeq_epi8(chunk, vb));
+        unsigned int mask = _mm_movemask_epi8(hit);
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+
+    while (p < end && *p != a && *p != b)
+        p++;
+    return p;
+}
+
+// 找 "\r\n"，返回 '\r' 的位置，找不到返回 NULL
+static const char *findcrlf(const char *p, const char *end)
+{
+    for (;;)
+    {
+        p = scan2(p, end, '\r', '\r');
+        if (end - p < 2)
+            return NULL;
+        if (p[1] == '\n')
+            return p;
+        p++;
+    }
+}
+
+struct request
+{
+    const char *method;
+    size_t methodlen;
+    const char *path;
+    size_t pathlen;
+    const char *body;
+    size_t bodylen;
+    bool keepalive;
+};
+
+static bool equals(const char *p, size_t n, const char *s)
+{
+    return n == strlen(s) && memcmp(p, s, n) == 0;
+}
+
+static bool iequals(const char *p, size_t n, const char *s)
+{
+    return n == strlen(s) && strncasecmp(p, s, n) == 0;
+}
+
+/**
+ * 解析一个完整的请求，结果中的指针都指向输入缓冲区。
+ * 返回值：>0 请求占用的字节数；0 数据不完整；-1 请求非法
+ * */
+static long parserequest(const char *start, size_t n, struct request *req)
+{
+    const char *end = start + n;
+
+    // 请求行：METHOD SP PATH SP VERSION CRLF
+    const char *eol = findcrlf(start, end);
+    if (eol == NULL)
+        return n > MAXHEADER ? -1 : 0;
+
+    const char *sp1 = scan2(start, eol, ' ', ' ');
+    if (sp1 == eol)
+        return -1;
+    const char *sp2 = scan2(sp1 + 1, eol, ' ', ' ');
+    if (sp2 == eol)
+        return -1;
+
+    req->method = start;
+    req->methodlen = sp1 - start;
+    req->path = sp1 + 1;
+    req->pathlen = sp2 - sp1 - 1;
+
+    const char *version = sp2 + 1;
+    size_t versionlen = eol - version;
+    if (equals(version, versionlen, "HTTP/1.1"))
+        req->keepalive = true;
+    else if (equals(version, versionlen, "HTTP/1.0"))
+        req->keepalive = false;
+    else
+        return -1;
+
+    // 报文头：NAME ':' VALUE CRLF，空行结束
+    size_t contentlength = 0;
+    const char *p = eol + 2;
+    for (;;)
+    {
+        if (end - p < 2)
+            return (size_t)(p - start) > MAXHEADER ? -1 : 0;
+        if (p[0] == '\r' && p[1] == '\n')
+        {
+            p += 2;
+            break;
+        }
+
+        // 一次扫描同时找 ':' 和行尾的 '\r'
+        const char *colon = scan2(p, end, ':', '\r');
+        if (colon == end)
+            return (size_t)(end - start) > MAXHEADER ? -1 : 0;
+        if (*colon != ':')
+            return -1;
+
+        eol = findcrlf(colon, end);
+        if (eol == NULL)
+            return (size_t)(end - start) > MAXHEADER ? -1 : 0;
+
+        const char *value = colon + 1;
+        while (value < eol && (*value == ' ' || *value == '\t'))
+            value++;
+        size_t valuelen = eol - value;
+        while (valuelen > 0 && (value[valuelen - 1] == ' ' || value[valuelen - 1] == '\t'))
+            valuelen--;
+
+        size_t namelen = colon - p;
+        if (iequals(p, namelen, "Content-Length"))
+        {
+            contentlength = 0;
+            for (size_t i = 0; i < valuelen; i++)
+            {
+                if (value[i] < '0' || value[i] > '9' || contentlength > MAXBODY)
+                    return -1;
+                contentlength = contentlength * 10 + (value[i] - '0');
+            }
+            if (contentlength > MAXBODY)
+                return -1;
+        }
+        else if (iequals(p, namelen, "Connection"))
+        {
+            if (iequals(value, valuelen, "close"))
+                req->keepalive = false;
+            else if (iequals(value, valuelen, "keep-alive"))
+                req->keepalive = true;
+        }
+        else if (iequals(p, namelen, "Transfer-Encoding"))
+        {
+            // 不支持 chunked
+            return -1;
+        }
+
+        p = eol + 2;
+    }
+
+    if ((size_t)(end - p) < contentlength)
+        return 0;
+
+    req->body = p;
+    req->bodylen = contentlength;
+    return p + contentlength - start;
+}
+
+struct conn
+{
+    // 输入缓冲区：[rpos, wpos) 是已读入但尚未解析的数据
+    char *buf;
+    size_t cap;
+    size_t rpos;
+    size_t wpos;
+    // 输出缓冲区
+    std::string out;
+    size_t outpos;
+    bool closing;   // 回复发完后关闭连接
+};
+
+static conn conns[MAXFDS];
+
+// /metrics 输出的计数
+static struct
+{
+    unsigned long long accepts;
+    unsigned long long active;
+    unsigned long long requests;
+    unsigned long long badrequests;
+    unsigned long long bytesin;
+    unsigned long long bytesout;
+} stats;
+
+static void respond(conn *c, int status, const char *reason, const char *body, size_t bodylen, bool keepalive)
+{
+    char head[256];
+    int n = snprintf(head, sizeof(head),
+                     "HTTP/1.1 %d %s\r\n"
+                     "Content-Type: text/plain\r\n"
+                     "Content-Length: %zu\r\n"
+                     "Connection: %s\r\n"
+                     "\r\n",
+                     status, reason, bodylen, keepalive ? "keep-alive" : "close");
+    c->out.append(head, n);
+    c->out.append(body, bodylen);
+}
+
+// 按路径分发请求
+static void handle(conn *c, const struct request *req)
+{
+    stats.requests++;
+
+    if (equals(req->path, req->pathlen, "/health"))
+    {
+        respond(c, 200, "OK", "ok\n", 3, req->keepalive);
+    }
+    else if (equals(req->path, req->pathlen, "/metrics"))
+    {
+        char body[512];
+        int n = snprintf(body, sizeof(body),
+                         "accepts %llu\n"
+                         "active_connections %llu\n"
+                         "requests %llu\n"
+                         "bad_requests %llu\n"
+                         "bytes_in %llu\n"
+                         "bytes_out %llu\n",
+                         stats.accepts, stats.active, stats.requests,
+                         stats.badrequests, stats.bytesin, stats.bytesout);
+        respond(c, 200, "OK", body, n, req->keepalive);
+    }
+    else if (equals(req->path, req->pathlen, "/echo"))
+    {
+        respond(c, 200, "OK", req->body, req->bodylen, req->keepalive);
+    }
+    else
+    {
+        respond(c, 404, "Not Found", "not found\n", 10, req->keepalive);
+    }
+
+    if (!req->keepalive)
+        c->closing = true;
+}
+
+static void process(conn *c)
+{
+    while (c->rpos < c->wpos && !c->closing)
+    {
+        struct request req;
+        long used = parserequest(c->buf + c->rpos, c->wpos - c->rpos, &req);
+        if (used < 0)
+        {
+            stats.badrequests++;
+            respond(c, 400, "Bad Request", "bad request\n", 12, false);
+            c->closing = true;
+            break;
+        }
+        if (used == 0)
+            break;
+
+        handle(c, &req);
+        c->rpos += used;
+    }
+
+    // 剩下的半个请求挪到缓冲区开头，缓冲区满了就扩容
+    size_t pending = c->wpos - c->rpos;
+    if (c->rpos > 0)
+    {
+        memmove(c->buf, c->buf + c->rpos, pending);
+        c->rpos = 0;
+        c->wpos = pending;
+    }
+    if (c->wpos == c->cap)
+    {
+        c->cap *= 2;
+        c->buf = (char *)realloc(c->buf, c->cap);
+    }
+}
+
+/**
+ * 尽量把输出缓冲区写出去。
+ * 返回 1 全部写完；0 socket 缓冲区满了还有剩余；-1 出错
+ * */
+static int flush(int fd, conn *c)
+{
+    while (c->outpos < c->out.size())
+    {
+        ssize_t n = write(fd, c->out.data() + c->outpos, c->out.size() - c->outpos);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        c->outpos += n;
+        stats.bytesout += n;
+    }
+
+    c->out.clear();
+    c->outpos = 0;
+    return 1;
+}
+
+static void watch(int epollfd, int fd, int op, uint32_t events)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(struct epoll_event));
+    ev.data.fd = fd;
+    ev.events = events;
+    epoll_ctl(epollfd, op, fd, &ev);
+}
+
+static void closeconn(int epollfd, int fd)
+{
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+    stats.active--;
+
+    conn *c = &conns[fd];
+    c->rpos = 0;
+    c->wpos = 0;
+    c->out.clear();
+    c->outpos = 0;
+    c->closing = false;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        printf("usage: ./epollhttpserverdemo port\n");
+        return -1;
+    }
+
+    // 用于监听的 socket
+    int listensock = initserver(atoi(argv[1]));
+    if (listensock < 0)
+    {
+        printf("initserver() failed.\n");
+        return -1;
+    }
+    printf("listensock=%d\n", listensock);
+
+    int epollfd = epoll_create(1);
+
+    watch(epollfd, listensock, EPOLL_CTL_ADD, EPOLLIN);
+
+    while (1)
+    {
+        struct epoll_event events[MAXEVENTS];
+
+        int readyfds = epoll_wait(epollfd, events, MAXEVENTS, -1);
+        if (readyfds == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll() failed");
+            break;
+        }
+
+        for (int i = 0; i < readyfds; i++)
+        {
+            int fd = events[i].data.fd;
+
+            // 新的客户端连接，压测时连接很多，这里不逐个打印
+            if (fd == listensock)
+            {
+                int clientsock = accept(listensock, NULL, NULL);
+                if (clientsock < 0)
+                {
+                    printf("accept() failed.\n");
+                    continue;
+                }
+                if (clientsock >= MAXFDS)
+                {
+                    close(clientsock);
+                    continue;
+                }
+
+                stats.accepts++;
+                stats.active++;
+
+                set_nonblocking(clientsock);
+                conn *c = &conns[clientsock];
+                if (c->buf == NULL)
+                {
+                    c->buf = (char *)malloc(INBUFSIZE);
+                    c->cap = INBUFSIZE;
+                }
+                watch(epollfd, clientsock, EPOLL_CTL_ADD, EPOLLIN);
+                continue;
+            }
+
+            conn *c = &conns[fd];
+
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
+            {
+                closeconn(epollfd, fd);
+                continue;
+            }
+
+            // 上一批回复没写完，socket 可写了继续写
+            if (events[i].events & EPOLLOUT)
+            {
+                int r = flush(fd, c);
+                if (r < 0 || (r == 1 && c->closing))
+                {
+                    closeconn(epollfd, fd);
+                    continue;
+                }
+                if (r == 1)
+                    watch(epollfd, fd, EPOLL_CTL_MOD, EPOLLIN);
+            }
+
+            if (!(events[i].events & EPOLLIN) || c->closing)
+                continue;
+
+            ssize_t isize = read(fd, c->buf + c->wpos, c->cap - c->wpos);
+            if (isize <= 0)
+            {
+                if (isize < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    continue;
+                closeconn(epollfd, fd);
+                continue;
+            }
+            c->wpos += isize;
+            stats.bytesin += isize;
+
+            bool hadpending = c->outpos < c->out.size();
+            process(c);
+
+            // 整批请求的回复只发一次；还在等 EPOLLOUT 的话不用着急写
+            if (hadpending)
+                continue;
+
+            int r = flush(fd, c);
+            if (r < 0 || (r == 1 && c->closing))
+                closeconn(epollfd, fd);
+            else if (r == 0)
+                watch(epollfd, fd, EPOLL_CTL_MOD, EPOLLIN | EPOLLOUT);
+        }
+    }
+
+    close(epollfd);
+
+    return 0;
+}
+
+// 初始化服务端的监听端口。
+int initserver(int port)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+    {
+        printf("socket() failed.\n");
+        return -1;
+    }
+
+    int opt = 1;
+    unsigned int len = sizeof(opt);
+
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, len);
+    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &opt, len);
+
+    struct sockaddr_in servaddr;
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    servaddr.sin_port = htons(port);
+
+    if (bind(sock, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0)
+    {
+        printf("bind() failed.\n");
+        close(sock);
+        return -1;
+    }
+
+    if (listen(sock, SOMAXCONN) != 0)
+    {
+        printf("listen() failed.\n");
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
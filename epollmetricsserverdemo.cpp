@@ -0,0 +1,1457 @@
+/**
+ * 服务端自己测量延迟：每线程 HDR 风格直方图
+ *
+ * 客户端测出来的延迟里混着客户端自己的调度、网络和协议栈的抖动，
+ * 想知道服务端内部的 p99/p999，就得在事件循环里打点：
+ *
+ *     readiness->flush   epoll_wait 返回（连接就绪）到这次就绪对应的回复完全写出
+ *     firstbyte->reply   读到一段数据到这段数据的回显完全写出，写缓冲满时会跨越多次 epoll_wait
+ *
+ * 直方图的桶按 HDR Histogram 的思路划分：每个 2 的幂区间再线性等分成 SUBBUCKETS 份，
+ * 相对误差不超过 1/SUBBUCKETS，覆盖纳秒到几十分钟只要一千多个桶，记录一次就是算下标加一。
+ *
+ * 多个事件循环线程用 SO_REUSEPORT 各自监听同一端口，每个线程一套直方图，只有自己写，
+ * 写的时候不用锁也不用原子加（单写者 relaxed store）；需要看的时候由主线程把所有线程的桶逐个读出来相加。
+ * 读到的可能是某个线程写到一半的状态，但每个桶本身是完整的，对统计来说足够了。
+ *
+ * 向进程发送 SIGUSR1 输出合并后的分位数：kill -USR1 <pid>
+ *
+ * -m port 另开一个监听端口，用 Prometheus 文本格式输出计数器和直方图（curl http://127.0.0.1:port/metrics）。
+ * 这个端口由 0 号事件循环顺带处理，不额外开线程；计数器同样是每线程一份、按 cache line 对齐，
+ * 抓取时只读不写，热路径上不会因为抓取多出任何竞争：
+ *     io_accepts_total / io_active_connections / io_bytes_{in,out}_total
+ *     io_wakeups_total / io_reads_total        两者相除就是每次唤醒平均读几次
+ *     io_eagain_total                         read/write 返回 EAGAIN 的次数，说明白白多了一次系统调用
+ *     io_epoll_batch_size                     每次 epoll_wait 返回的事件数分布
+ *     io_readiness_to_flush_seconds / io_firstbyte_to_reply_seconds
+ *
+ * -s name 把每个事件循环的计数器发布到 POSIX 共享内存 /dev/shm/name 中，配合 iotop.cpp 实时查看。
+ * 对延迟敏感的进程不想多开一个 HTTP 端口时用这个：事件循环每 100ms 把自己的计数器拷贝到共享内存里的一个槽位，
+ * 槽位用 seqlock 保护：写之前序号加一变成奇数，写完再加一变回偶数；
+ * 读者读之前和读之后各看一次序号，两次相同且为偶数才说明读到的是同一时刻的完整快照，否则重读。
+ * 写者从不等待读者，读者再多也不会拖慢事件循环。
+ *
+ * -P 每个事件循环线程用 perf_event_open 打开一组只统计本线程的硬件计数器：
+ * cycles、instructions、cache-misses、branch-misses，SIGUSR1 和 metrics 端口上按回复数归一化输出，
+ * 不用外部 profiler 就能比较连接结构、缓冲区布局改动前后每条消息花了多少周期、多少次缓存未命中。
+ * 计数器由内核维护，事件循环里没有任何额外代码；kernel.perf_event_paranoid 为 2 时只能统计用户态。
+ *
+ * -w us 启动一个看门狗线程，检查每个事件循环的心跳：事件循环每次从 epoll_wait 返回时记下时间，
+ * 处理每个事件前记下当前的阶段和 fd。某一轮处理超过 us 微秒还没回到 epoll_wait，看门狗就打印
+ * 卡住的阶段和连接，并用信号打断这个线程，在信号处理函数里用 backtrace 抓下它此刻的调用栈。
+ * 长时间的处理卡顿是尾延迟的主要来源，没有看门狗时事件循环自己根本不会报告。
+ *
+ * -T 在接受的连接上打开 SO_TIMESTAMPING 软件接收时间戳，读数据改用 recvmsg，从控制消息里取出内核收到数据的时间，
+ * 把“数据在 socket 缓冲区里等了多久”拆成两段：
+ *     rx->ready   内核收到数据到 epoll_wait 返回，事件循环还在忙上一批事件或者线程没被调度
+ *     rx->read    内核收到数据到真正 read 出来，多出来的部分是同一批里排在前面的事件花的时间
+ * 前者大说明线程不够，后者大说明一批事件太多（MAXEVENTS 偏大）或单个事件处理太慢。
+ * TCP 一次 recvmsg 可能读到多个报文，内核给出的是其中最后一个报文的时间戳，所以这是偏小的估计。
+ *
+ * 内置采样 profiler：kill -USR2 <pid> 开始，再发一次停止，把采到的调用栈按 folded 格式写到 profile-<pid>.folded，
+ * 可以直接交给 flamegraph.pl 画火焰图；也可以在 metrics 端口上 GET /profile/start 和 GET /profile/stop，
+ * 后者直接把 folded 文本作为响应返回。生产容器里不一定能装 perf、也不一定有权限 attach，这样就够用了。
+ * 停止时要把上万个调用栈符号化、汇总，两条路径都交给主线程去做：/profile/stop 只是通知主线程，
+ * 主线程汇总完通过 eventfd 把结果交回 0 号事件循环再回复，不会卡住 0 号循环上的其他连接。
+ * 每个事件循环线程一个 timer_create 定时器，按这个线程自己消耗的 CPU 时间每 1ms 给它发一次 SIGPROF，
+ * 阻塞在 epoll_wait 里的时间不会被采到。信号处理函数只做 backtrace，写进本线程自己的样本数组，
+ * 样本数组只有这一个写者，用一个 release 的计数发布，不需要锁。
+ *
+ * 编译：g++ -std=c++17 -O2 -pthread -rdynamic -o epollmetricsserverdemo epollmetricsserverdemo.cpp
+ * 示例：./epollmetricsserverdemo -t 4 -m 9100 -s iodemo -P -w 10000 5005
+ * */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <execinfo.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include <dlfcn.h>
+#include <cxxabi.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/fcntl.h>
+#include <sys/types.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+
+#define MAXEVENTS 1024
+#define MAXFDS 65536
+#define BUFSIZE 16384
+
+// 每个 2 的幂区间分成 2^SUBBITS 个桶，最大记录 2^MAXBITS 纳秒（约 18 分钟），更大的值记在最后一个桶
+#define SUBBITS 5
+#define SUBBUCKETS (1 << SUBBITS)
+#define MAXBITS 40
+#define NBUCKETS ((MAXBITS - SUBBITS + 1) * SUBBUCKETS)
+// epoll_wait 批大小按 1,2,4,...,MAXEVENTS 分桶
+#define BATCHBUCKETS 11
+
+// 共享内存统计段，布局必须与 iotop.cpp 一致
+#define STATSMAGIC 0x494f5354
+#define MAXLOOPS 64
+#define PUBLISHMS 100
+
+// 看门狗抓取调用栈用的信号和最大栈深度
+#define STALLSIG (SIGRTMIN + 1)
+#define MAXFRAMES 32
+
+// 采样 profiler：每个线程每消耗 1ms CPU 采一次，每个线程最多保存 MAXSAMPLES 个样本
+#define PROFILEINTERVALNS 1000000
+#define MAXSAMPLES 20000
+// 0 号事件循环请主线程停止采样、汇总结果用的信号
+#define PROFILESIG (SIGRTMIN + 2)
+
+// 老版本 glibc 没有这个宏
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+int initserver(int port);
+
+static void set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags == -1) {
+    perror("fcntl()");
+    return;
+  }
+  if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    perror("fcntl()");
+  }
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// 单写者计数器：只有所属线程修改，其他线程只读
+static void bump(std::atomic<uint64_t> &counter, uint64_t n = 1)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+/**
+ * 小于 2*SUBBUCKETS 的值每个值一个桶；更大的值取最高位，
+ * 最高位往下 SUBBITS 位决定落在这个 2 的幂区间的第几份
+ * */
+static int bucketof(uint64_t v)
+{
+    if (v < 2 * SUBBUCKETS)
+        return (int)v;
+
+    int msb = 63 - __builtin_clzll(v);
+    if (msb >= MAXBITS)
+        return NBUCKETS - 1;
+
+    int shift = msb - SUBBITS;
+    return (shift + 1) * SUBBUCKETS + (int)((v >> shift) - SUBBUCKETS);
+}
+
+// 桶内的最大值，报告分位数时用它，保证不会低估
+static uint64_t bucketmax(int b)
+{
+    if (b < 2 * SUBBUCKETS)
+        return b;
+
+    int shift = b / SUBBUCKETS - 1;
+    uint64_t low = (uint64_t)(b % SUBBUCKETS + SUBBUCKETS) << shift;
+    return low + (1ULL << shift) - 1;
+}
+
+struct histogram
+{
+    std::atomic<uint64_t> counts[NBUCKETS];
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> max;
+
+    void record(uint64_t v)
+    {
+        bump(counts[bucketof(v)]);
+        bump(total);
+        bump(sum, v);
+        if (v > max.load(std::memory_order_relaxed))
+            max.store(v, std::memory_order_relaxed);
+    }
+};
+
+// 合并后的快照，只在报告时使用
+struct histsnapshot
+{
+    uint64_t counts[NBUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+
+    void add(const histogram &h)
+    {
+        for (int b = 0; b < NBUCKETS; b++)
+            counts[b] += h.counts[b].load(std::memory_order_relaxed);
+        total += h.total.load(std::memory_order_relaxed);
+        sum += h.sum.load(std::memory_order_relaxed);
+        uint64_t m = h.max.load(std::memory_order_relaxed);
+        if (m > max)
+            max = m;
+    }
+
+    uint64_t percentile(double p) const
+    {
+        uint64_t rank = (uint64_t)(p * total);
+        uint64_t seen = 0;
+        for (int b = 0; b < NBUCKETS; b++)
+        {
+            seen += counts[b];
+            if (seen > rank)
+                return bucketmax(b) < max ? bucketmax(b) : max;
+        }
+        return max;
+    }
+
+    // 不超过 limit 的记录数。只统计桶上界不超过 limit 的桶，跨界的桶算到下一档
+    uint64_t countbelow(uint64_t limit) const
+    {
+        uint64_t n = 0;
+        for (int b = 0; b < NBUCKETS && bucketmax(b) <= limit; b++)
+            n += counts[b];
+        return n;
+    }
+};
+
+struct conn
+{
+    std::string out;        // 还没写出去的回显数据
+    size_t outpos;
+    uint64_t firstbyte;     // out 中最早那个字节被读到的时间
+    bool writing;           // 是否在等 EPOLLOUT
+    bool metrics;           // 是 metrics 端口上的连接，不是回显连接
+    std::string in;         // metrics 连接收到的请求
+};
+
+static conn conns[MAXFDS];
+
+enum
+{
+    ST_TIME,        // 快照时间，CLOCK_MONOTONIC 纳秒，查看端用它算速率
+    ST_ACCEPTS,
+    ST_CLOSES,
+    ST_BYTESIN,
+    ST_BYTESOUT,
+    ST_READS,
+    ST_WRITES,
+    ST_EAGAIN,
+    ST_WAKEUPS,
+    ST_EVENTS,
+    ST_REPLIES,
+    NSTATS
+};
+
+// 一个事件循环的快照，seq 为奇数表示正在写
+struct alignas(64) statsslot
+{
+    std::atomic<uint32_t> seq;
+    std::atomic<uint64_t> values[NSTATS];
+};
+
+struct statssegment
+{
+    uint32_t magic;
+    uint32_t nloops;
+    int32_t pid;
+    statsslot loops[MAXLOOPS];
+};
+
+static statssegment *stats;
+
+// 只统计回显连接，metrics 连接不计入
+struct alignas(64) loopcounters
+{
+    std::atomic<uint64_t> accepts;
+    std::atomic<uint64_t> closes;
+    std::atomic<uint64_t> bytesin;
+    std::atomic<uint64_t> bytesout;
+    std::atomic<uint64_t> reads;
+    std::atomic<uint64_t> writes;
+    std::atomic<uint64_t> eagain;
+    std::atomic<uint64_t> wakeups;
+    std::atomic<uint64_t> events;
+    std::atomic<uint64_t> batches[BATCHBUCKETS];
+};
+
+// 按 cache line 对齐，不同线程的计数器和直方图不会落在同一行上
+enum
+{
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHEMISSES,
+    PERF_BRANCHMISSES,
+    NPERF
+};
+
+// 事件循环当前所处的阶段，看门狗报告卡顿时用
+enum
+{
+    PHASE_WAIT,
+    PHASE_ACCEPT,
+    PHASE_READ,
+    PHASE_FLUSH,
+    PHASE_METRICS,
+    PHASE_PUBLISH,
+    NPHASES
+};
+
+static const char *phasenames[NPHASES] = {"wait", "accept", "read", "flush", "metrics", "publish"};
+
+static const char *perfnames[NPERF] = {"cycles", "instructions", "cache_misses", "branch_misses"};
+static const uint64_t perfconfigs[NPERF] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                            PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+
+struct alignas(64) eventloop
+{
+    int id;
+    int listensock;
+    int metricssock;        // 只有 0 号事件循环有，其他为 -1
+    int epollfd;
+    pthread_t thread;
+
+    loopcounters counters;
+    histogram readytoflush;
+    histogram firsttoreply;
+    histogram rxtoready;
+    histogram rxtoread;
+
+    uint64_t lastpublish;
+
+    // 硬件计数器组，perfleader 为 -1 表示没有打开；perfslot 是每个计数器在组读取结果中的位置，-1 表示不支持。
+    // 其他线程可能同时在读，perfleader 最后才发布
+    std::atomic<int> perfleader;
+    int perfslot[NPERF];
+    bool perfuseronly;
+
+    // 心跳，事件循环写、看门狗读，单独占一个 cache line。busysince 为 0 表示正阻塞在 epoll_wait 中
+    alignas(64) std::atomic<uint64_t> busysince;
+    std::atomic<uint64_t> iteration;
+    std::atomic<int> phase;
+    std::atomic<int> phasefd;
+
+    // 以下只由看门狗线程和本线程的信号处理函数使用
+    alignas(64) uint64_t reportediteration;
+    std::atomic<uint64_t> stalls;
+    void *frames[MAXFRAMES];
+    std::atomic<int> nframes;      // -1 表示正在等信号处理函数抓栈
+    uint64_t capturediteration;    // 抓栈时事件循环所在的迭代
+
+    // 采样 profiler，样本只由本线程的 SIGPROF 处理函数写入
+    std::atomic<pid_t> tid;
+    timer_t proftimer;
+    struct sample *samples;
+    std::atomic<size_t> nsamples;
+};
+
+struct sample
+{
+    int nframes;
+    void *frames[MAXFRAMES];
+};
+
+static std::atomic<bool> profiling;
+static std::mutex profilelock;
+
+// /profile/stop：0 号事件循环记下等结果的连接，通知主线程；主线程汇总好放进 profileresult，写 profilewakefd 叫醒它
+static int profilewaiter = -1;         // 只由 0 号事件循环访问，-1 表示没有连接在等
+static int profilewakefd = -1;
+static std::mutex resultlock;
+static std::string profileresult;      // resultlock 保护
+static bool profileresultready;        // resultlock 保护
+static pthread_t mainthread;
+
+static bool timestamping;
+
+static thread_local eventloop *currentloop;
+static uint64_t stallthreshold;    // 纳秒，0 表示没有开启看门狗
+
+static bool perfenabled;
+
+static std::vector<eventloop *> loops;
+
+static inline void setphase(eventloop *loop, int phase, int fd)
+{
+    loop->phase.store(phase, std::memory_order_relaxed);
+    loop->phasefd.store(fd, std::memory_order_relaxed);
+}
+
+// 在卡住的事件循环线程里执行，只做 backtrace 这一件事
+static void onstallsignal(int)
+{
+    eventloop *loop = currentloop;
+    if (loop == NULL)
+        return;
+    int n = backtrace(loop->frames, MAXFRAMES);
+    loop->capturediteration = loop->iteration.load(std::memory_order_relaxed);
+    loop->nframes.store(n, std::memory_order_release);
+}
+
+static void onprofsignal(int)
+{
+    eventloop *loop = currentloop;
+    if (loop == NULL || !profiling.load(std::memory_order_relaxed))
+        return;
+
+    size_t n = loop->nsamples.load(std::memory_order_relaxed);
+    if (n >= MAXSAMPLES)
+        return;
+    sample *s = &loop->samples[n];
+    s->nframes = backtrace(s->frames, MAXFRAMES);
+    loop->nsamples.store(n + 1, std::memory_order_release);
+}
+
+/**
+ * 开始采样，返回 -1 表示已经在采样。由主线程（SIGUSR2）或 0 号事件循环（/profile/start）调用
+ * */
+static int startprofile()
+{
+    std::lock_guard<std::mutex> guard(profilelock);
+    if (profiling.load(std::memory_order_relaxed))
+        return -1;
+
+    for (size_t i = 0; i < loops.size(); i++)
+    {
+        if (loops[i]->samples == NULL)
+            loops[i]->samples = new sample[MAXSAMPLES];
+        loops[i]->nsamples.store(0, std::memory_order_relaxed);
+    }
+    profiling.store(true, std::memory_order_release);
+
+    for (size_t i = 0; i < loops.size(); i++)
+    {
+        eventloop *loop = loops[i];
+
+        // 定时器按这个线程自己的 CPU 时间计时，到期的信号也只发给这个线程
+        clockid_t clock;
+        if (pthread_getcpuclockid(loop->thread, &clock) != 0)
+            continue;
+
+        struct sigevent sev;
+        memset(&sev, 0, sizeof(sev));
+        sev.sigev_notify = SIGEV_THREAD_ID;
+        sev.sigev_signo = SIGPROF;
+        sev.sigev_notify_thread_id = loop->tid.load(std::memory_order_relaxed);
+        if (timer_create(clock, &sev, &loop->proftimer) != 0)
+        {
+            perror("timer_create()");
+            loop->proftimer = NULL;
+            continue;
+        }
+
+        struct itimerspec its;
+        its.it_interval.tv_sec = 0;
+        its.it_interval.tv_nsec = PROFILEINTERVALNS;
+        its.it_value = its.it_interval;
+        timer_settime(loop->proftimer, 0, &its, NULL);
+    }
+    return 0;
+}
+
+// 函数名，没有导出的静态函数只能给出模块名加偏移，用 addr2line 可以还原
+static std::string symbolize(void *addr)
+{
+    Dl_info info;
+    if (dladdr(addr, &info) == 0 || info.dli_fname == NULL)
+        return "[unknown]";
+
+    if (info.dli_sname != NULL)
+    {
+        int status;
+        char *demangled = abi::__cxa_demangle(info.dli_sname, NULL, NULL, &status);
+        std::string name = status == 0 ? demangled : info.dli_sname;
+        free(demangled);
+        return name;
+    }
+
+    const char *module = strrchr(info.dli_fname, '/');
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s+0x%lx", module != NULL ? module + 1 : info.dli_fname,
+             (unsigned long)((char *)addr - (char *)info.dli_fbase));
+    return buf;
+}
+
+/**
+ * 停止采样，把样本汇总成 folded 格式：每行一个调用栈，从外到内用分号连接，最后是样本数。
+ * 最外层加上事件循环编号，火焰图上可以按线程分开看。返回 -1 表示没有在采样
+ * */
+static int stopprofile(std::string &folded)
+{
+    std::lock_guard<std::mutex> guard(profilelock);
+    if (!profiling.load(std::memory_order_relaxed))
+        return -1;
+
+    for (size_t i = 0; i < loops.size(); i++)
+        if (loops[i]->proftimer != NULL)
+        {
+            timer_delete(loops[i]->proftimer);
+            loops[i]->proftimer = NULL;
+        }
+    profiling.store(false, std::memory_order_release);
+
+    std::map<void *, std::string> names;
+    std::map<std::string, uint64_t> stacks;
+    for (size_t i = 0; i < loops.size(); i++)
+    {
+        eventloop *loop = loops[i];
+        size_t n = loop->nsamples.load(std::memory_order_acquire);
+        for (size_t k = 0; k < n; k++)
+        {
+            const sample *s = &loop->samples[k];
+            std::string stack = "loop" + std::to_string(loop->id);
+
+            // 前两帧是信号处理函数和内核的信号返回跳板，跳过
+            for (int f = s->nframes - 1; f >= 2; f--)
+            {
+                auto it = names.find(s->frames[f]);
+                if (it == names.end())
+                    it = names.emplace(s->frames[f], symbolize(s->frames[f])).first;
+                stack += ';';
+                stack += it->second;
+            }
+            stacks[stack]++;
+        }
+    }
+
+    for (auto &entry : stacks)
+        folded += entry.first + " " + std::to_string(entry.second) + "\n";
+    return 0;
+}
+
+/**
+ * 看门狗线程。检查间隔是阈值的一半，所以一次卡顿最晚在 1.5 倍阈值时被发现；
+ * 同一轮迭代只报告一次
+ * */
+static void *watchdog(void *)
+{
+    uint64_t period = stallthreshold / 2 > 100000 ? stallthreshold / 2 : 100000;
+
+    while (1)
+    {
+        usleep(period / 1000);
+        uint64_t now = now_ns();
+
+        for (size_t i = 0; i < loops.size(); i++)
+        {
+            eventloop *loop = loops[i];
+            uint64_t since = loop->busysince.load(std::memory_order_relaxed);
+            uint64_t iteration = loop->iteration.load(std::memory_order_relaxed);
+            if (since == 0 || now < since || now - since < stallthreshold || loop->reportediteration == iteration)
+                continue;
+
+            loop->reportediteration = iteration;
+            bump(loop->stalls);
+            int phase = loop->phase.load(std::memory_order_relaxed);
+            int fd = loop->phasefd.load(std::memory_order_relaxed);
+
+            // 打断卡住的线程抓调用栈，最多等 100ms
+            loop->nframes.store(-1, std::memory_order_relaxed);
+            pthread_kill(loop->thread, STALLSIG);
+            int n = -1;
+            for (int wait = 0; wait < 100 && (n = loop->nframes.load(std::memory_order_acquire)) < 0; wait++)
+                usleep(1000);
+
+            // 信号送达之前这一轮可能已经结束了，抓到的就不是卡住时的栈
+            bool ended = n < 0 || loop->capturediteration != iteration;
+            printf("loop %d stalled for %.1f ms in %s (fd=%d)%s\n", loop->id, (now - since) / 1e6,
+                   phasenames[phase], fd, ended ? ", ended before the stack was captured" : "");
+            fflush(stdout);
+            if (n > 0)
+                backtrace_symbols_fd(loop->frames, n, STDOUT_FILENO);
+        }
+    }
+    return NULL;
+}
+
+static int perfopen(uint64_t config, int group, bool useronly)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.disabled = group == -1;    // 组长先不启动，整组打开之后一起启动
+    attr.exclude_kernel = useronly;
+    attr.exclude_hv = 1;
+
+    // pid = 0, cpu = -1：统计调用线程本身，不管它跑在哪个 CPU 上
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group, PERF_FLAG_FD_CLOEXEC);
+}
+
+/**
+ * 在事件循环线程里调用，打开只统计本线程的计数器组。不支持的计数器（比如虚拟机里的 cache-misses）跳过
+ * */
+static void openperf(eventloop *loop)
+{
+    for (int k = 0; k < NPERF; k++)
+        loop->perfslot[k] = -1;
+
+    // 先试着连内核态一起统计，权限不够再退回只统计用户态
+    loop->perfuseronly = false;
+    int leader = perfopen(perfconfigs[PERF_CYCLES], -1, false);
+    if (leader < 0 && (errno == EACCES || errno == EPERM))
+    {
+        loop->perfuseronly = true;
+        leader = perfopen(perfconfigs[PERF_CYCLES], -1, true);
+    }
+    if (leader < 0)
+    {
+        printf("loop %d: perf_event_open() failed: %s\n", loop->id, strerror(errno));
+        return;
+    }
+
+    int slots = 0;
+    loop->perfslot[PERF_CYCLES] = slots++;
+    for (int k = PERF_CYCLES + 1; k < NPERF; k++)
+    {
+        // 组员的 fd 不用保存，读组长就能一次读出整组，关闭组长时一起释放
+        if (perfopen(perfconfigs[k], leader, loop->perfuseronly) >= 0)
+            loop->perfslot[k] = slots++;
+        else
+            printf("loop %d: %s not supported: %s\n", loop->id, perfnames[k], strerror(errno));
+    }
+
+    ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    loop->perfleader.store(leader, std::memory_order_release);
+}
+
+/**
+ * 读出一个事件循环的计数器，可以在任何线程里调用。不支持的计数器为 0，返回 -1 表示没有打开
+ * */
+static int readperf(const eventloop *loop, uint64_t *values)
+{
+    int leader = loop->perfleader.load(std::memory_order_acquire);
+    if (leader < 0)
+        return -1;
+
+    uint64_t buf[1 + NPERF];
+    if (read(leader, buf, sizeof(buf)) < (ssize_t)sizeof(uint64_t))
+        return -1;
+
+    for (int k = 0; k < NPERF; k++)
+        values[k] = loop->perfslot[k] >= 0 && (uint64_t)loop->perfslot[k] < buf[0] ? buf[1 + loop->perfslot[k]] : 0;
+    return 0;
+}
+
+static void watch(eventloop *loop, int fd, bool writing)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.data.fd = fd;
+    ev.events = writing ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    epoll_ctl(loop->epollfd, EPOLL_CTL_MOD, fd, &ev);
+    conns[fd].writing = writing;
+}
+
+static void closeconn(eventloop *loop, int fd)
+{
+    // 等结果的连接提前断开了，结果回来时直接丢弃
+    if (fd == profilewaiter)
+        profilewaiter = -1;
+    epoll_ctl(loop->epollfd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+    if (!conns[fd].metrics)
+        bump(loop->counters.closes);
+    conns[fd].out.clear();
+    conns[fd].outpos = 0;
+    conns[fd].writing = false;
+    conns[fd].metrics = false;
+    conns[fd].in.clear();
+}
+
+/**
+ * 把 out 尽量写出去。全部写完时记录两个延迟，返回 0；写缓冲满返回 0 并等 EPOLLOUT；出错返回 -1。
+ * metrics 连接写完响应后返回 1，由调用者关闭
+ * */
+static int flush(eventloop *loop, int fd, uint64_t ready)
+{
+    conn *c = &conns[fd];
+
+    while (c->outpos < c->out.size())
+    {
+        ssize_t n = write(fd, c->out.data() + c->outpos, c->out.size() - c->outpos);
+        if (!c->metrics)
+            bump(loop->counters.writes);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                if (!c->metrics)
+                    bump(loop->counters.eagain);
+                if (!c->writing)
+                    watch(loop, fd, true);
+                return 0;
+            }
+            return -1;
+        }
+        c->outpos += n;
+        if (!c->metrics)
+            bump(loop->counters.bytesout, n);
+    }
+
+    if (c->metrics)
+        return 1;
+
+    uint64_t done = now_ns();
+    loop->readytoflush.record(done - ready);
+    loop->firsttoreply.record(done - c->firstbyte);
+
+    c->out.clear();
+    c->outpos = 0;
+    if (c->writing)
+        watch(loop, fd, false);
+    return 0;
+}
+
+/**
+ * 把本循环的计数器写进共享内存里自己的槽位。每个槽位只有一个写者，所以不需要锁，
+ * 序号和数据之间的顺序由两道 release 栅栏保证
+ * */
+static void publish(eventloop *loop, uint64_t now)
+{
+    statsslot *slot = &stats->loops[loop->id];
+    const loopcounters &c = loop->counters;
+
+    uint32_t seq = slot->seq.load(std::memory_order_relaxed);
+    slot->seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot->values[ST_TIME].store(now, std::memory_order_relaxed);
+    slot->values[ST_ACCEPTS].store(c.accepts.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    slot->values[ST_CLOSES].store(c.closes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    slot->values[ST_BYTESIN].store(c.bytesin.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    slot->values[ST_BYTESOUT].store(c.bytesout.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    slot->values[ST_READS].store(c.reads.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    slot->values[ST_WRITES].store(c.writes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    slot->values[ST_EAGAIN].store(c.eagain.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    slot->values[ST_WAKEUPS].store(c.wakeups.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    slot->values[ST_EVENTS].store(c.events.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    slot->values[ST_REPLIES].store(loop->readytoflush.total.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+    slot->seq.store(seq + 2, std::memory_order_release);
+    loop->lastpublish = now;
+}
+
+static statssegment *createstats(const char *name, int nloops)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "/%s", name);
+
+    int fd = shm_open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        perror("shm_open()");
+        return NULL;
+    }
+    if (ftruncate(fd, sizeof(statssegment)) != 0)
+    {
+        perror("ftruncate()");
+        close(fd);
+        return NULL;
+    }
+
+    void *p = mmap(NULL, sizeof(statssegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        perror("mmap()");
+        return NULL;
+    }
+
+    // 新建的共享内存全是 0，所有槽位的序号都是偶数，可以直接读
+    statssegment *seg = (statssegment *)p;
+    seg->nloops = nloops;
+    seg->pid = getpid();
+    std::atomic_thread_fence(std::memory_order_release);
+    seg->magic = STATSMAGIC;
+    return seg;
+}
+
+static void appendf(std::string &s, const char *fmt, ...)
+{
+    char line[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    s.append(line, n < (int)sizeof(line) ? n : sizeof(line) - 1);
+}
+
+// 每个事件循环一行，带 loop 标签
+static void appendcounter(std::string &s, const char *name, const char *type, const char *help,
+                          uint64_t (*get)(const eventloop *))
+{
+    appendf(s, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    for (size_t i = 0; i < loops.size(); i++)
+        appendf(s, "%s{loop=\"%d\"} %llu\n", name, loops[i]->id, (unsigned long long)get(loops[i]));
+}
+
+static uint64_t load(const std::atomic<uint64_t> &counter)
+{
+    return counter.load(std::memory_order_relaxed);
+}
+
+// 直方图在所有事件循环上合并后输出，单位换算成秒
+static void appendlatency(std::string &s, const char *name, const char *help, histogram eventloop::*member)
+{
+    static const uint64_t bounds[] = {1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000,
+                                      500000, 1000000, 2500000, 5000000, 10000000, 100000000, 1000000000};
+    static histsnapshot snap;
+    memset(&snap, 0, sizeof(snap));
+    for (size_t i = 0; i < loops.size(); i++)
+        snap.add(loops[i]->*member);
+
+    appendf(s, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (size_t i = 0; i < sizeof(bounds) / sizeof(bounds[0]); i++)
+        appendf(s, "%s_bucket{le=\"%g\"} %llu\n", name, bounds[i] / 1e9, (unsigned long long)snap.countbelow(bounds[i]));
+    appendf(s, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)snap.total);
+    appendf(s, "%s_sum %.9f\n%s_count %llu\n", name, snap.sum / 1e9, name, (unsigned long long)snap.total);
+}
+
+static void render(std::string &s)
+{
+    appendcounter(s, "io_accepts_total", "counter", "Accepted connections.",
+                  [](const eventloop *l) { return load(l->counters.accepts); });
+    appendcounter(s, "io_active_connections", "gauge", "Open connections.",
+                  [](const eventloop *l) { return load(l->counters.accepts) - load(l->counters.closes); });
+    appendcounter(s, "io_bytes_in_total", "counter", "Bytes read from clients.",
+                  [](const eventloop *l) { return load(l->counters.bytesin); });
+    appendcounter(s, "io_bytes_out_total", "counter", "Bytes written to clients.",
+                  [](const eventloop *l) { return load(l->counters.bytesout); });
+    appendcounter(s, "io_reads_total", "counter", "read() calls.",
+                  [](const eventloop *l) { return load(l->counters.reads); });
+    appendcounter(s, "io_writes_total", "counter", "write() calls.",
+                  [](const eventloop *l) { return load(l->counters.writes); });
+    appendcounter(s, "io_eagain_total", "counter", "read()/write() calls that returned EAGAIN.",
+                  [](const eventloop *l) { return load(l->counters.eagain); });
+    appendcounter(s, "io_wakeups_total", "counter", "epoll_wait() returns with at least one event.",
+                  [](const eventloop *l) { return load(l->counters.wakeups); });
+    appendcounter(s, "io_stalls_total", "counter", "Loop iterations that exceeded the watchdog threshold.",
+                  [](const eventloop *l) { return load(l->stalls); });
+
+    // 批大小分布也在所有事件循环上合并
+    uint64_t batches[BATCHBUCKETS] = {0};
+    uint64_t wakeups = 0, events = 0;
+    for (size_t i = 0; i < loops.size(); i++)
+    {
+        for (int b = 0; b < BATCHBUCKETS; b++)
+            batches[b] += load(loops[i]->counters.batches[b]);
+        wakeups += load(loops[i]->counters.wakeups);
+        events += load(loops[i]->counters.events);
+    }
+    appendf(s, "# HELP io_epoll_batch_size Events returned per epoll_wait().\n# TYPE io_epoll_batch_size histogram\n");
+    uint64_t cumulative = 0;
+    for (int b = 0; b < BATCHBUCKETS; b++)
+    {
+        cumulative += batches[b];
+        appendf(s, "io_epoll_batch_size_bucket{le=\"%d\"} %llu\n", 1 << b, (unsigned long long)cumulative);
+    }
+    appendf(s, "io_epoll_batch_size_bucket{le=\"+Inf\"} %llu\n", (unsigned long long)wakeups);
+    appendf(s, "io_epoll_batch_size_sum %llu\nio_epoll_batch_size_count %llu\n",
+            (unsigned long long)events, (unsigned long long)wakeups);
+
+    appendlatency(s, "io_readiness_to_flush_seconds", "From epoll_wait() return to reply fully written.",
+                  &eventloop::readytoflush);
+    appendlatency(s, "io_firstbyte_to_reply_seconds", "From data read to its echo fully written.",
+                  &eventloop::firsttoreply);
+    if (timestamping)
+    {
+        appendlatency(s, "io_rx_to_ready_seconds", "From kernel receive timestamp to epoll_wait() return.",
+                      &eventloop::rxtoready);
+        appendlatency(s, "io_rx_to_read_seconds", "From kernel receive timestamp to the data being read.",
+                      &eventloop::rxtoread);
+    }
+
+    // 所有事件循环都没能打开计数器时（比如虚拟机没有 PMU）不输出这一组指标
+    bool anyperf = false;
+    for (size_t i = 0; i < loops.size(); i++)
+        anyperf |= loops[i]->perfleader.load(std::memory_order_acquire) >= 0;
+    if (!anyperf)
+        return;
+
+    uint64_t values[NPERF];
+    for (int k = 0; k < NPERF; k++)
+    {
+        appendf(s, "# HELP io_perf_%s_total Hardware %s counted on the loop thread.\n# TYPE io_perf_%s_total counter\n",
+                perfnames[k], perfnames[k], perfnames[k]);
+        for (size_t i = 0; i < loops.size(); i++)
+            if (readperf(loops[i], values) == 0 && loops[i]->perfslot[k] >= 0)
+                appendf(s, "io_perf_%s_total{loop=\"%d\"} %llu\n", perfnames[k], loops[i]->id, (unsigned long long)values[k]);
+    }
+}
+
+// 给 metrics 连接回复 body，返回值同 flush
+static int respond(eventloop *loop, int fd, const std::string &body)
+{
+    conn *c = &conns[fd];
+    appendf(c->out, "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                    "Content-Length: %zu\r\nConnection: close\r\n\r\n", body.size());
+    c->out += body;
+    c->outpos = 0;
+    return flush(loop, fd, 0);
+}
+
+/**
+ * metrics 连接：收齐请求头之后不管路径，一律返回全部指标然后关闭连接
+ * */
+static int handlemetrics(eventloop *loop, int fd, const char *data, size_t len)
+{
+    conn *c = &conns[fd];
+    if (!c->out.empty() || fd == profilewaiter)
+        return 0;
+
+    c->in.append(data, len);
+    if (c->in.find("\r\n\r\n") == std::string::npos)
+        return c->in.size() > BUFSIZE ? -1 : 0;
+
+    // 除了两个 profiler 控制路径，其他路径一律返回指标
+    std::string body;
+    if (c->in.compare(0, 20, "GET /profile/start H") == 0)
+        body = startprofile() == 0 ? "profiling started\n" : "already profiling\n";
+    else if (c->in.compare(0, 19, "GET /profile/stop H") == 0)
+    {
+        if (profilewaiter >= 0)
+            body = "profile stop already in progress\n";
+        else
+        {
+            // 先不回复，结果由主线程汇总好之后在 finishprofile() 里发出去
+            profilewaiter = fd;
+            pthread_kill(mainthread, PROFILESIG);
+            return 0;
+        }
+    }
+    else
+        render(body);
+
+    return respond(loop, fd, body);
+}
+
+// profilewakefd 可读：取回主线程汇总好的结果，回复给等着的连接
+static void finishprofile(eventloop *loop)
+{
+    uint64_t count;
+    if (read(profilewakefd, &count, sizeof(count)) < 0)
+        return;
+
+    std::string body;
+    {
+        std::lock_guard<std::mutex> guard(resultlock);
+        if (!profileresultready)
+            return;
+        body.swap(profileresult);
+        profileresultready = false;
+    }
+
+    int fd = profilewaiter;
+    if (fd < 0)
+        return;
+    profilewaiter = -1;
+    if (respond(loop, fd, body) != 0)
+        closeconn(loop, fd);
+}
+
+/**
+ * 带接收时间戳的 read。内核时间戳是 CLOCK_REALTIME，事件循环用的是 CLOCK_MONOTONIC，
+ * 读完立刻各取一次两个时钟，把时间戳换算过来
+ * */
+static ssize_t recvstamped(eventloop *loop, int fd, char *buffer, size_t size, uint64_t ready)
+{
+    struct iovec iov;
+    iov.iov_base = buffer;
+    iov.iov_len = size;
+
+    char control[CMSG_SPACE(sizeof(struct scm_timestamping))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n = recvmsg(fd, &msg, 0);
+    if (n <= 0)
+        return n;
+
+    struct timespec real;
+    clock_gettime(CLOCK_REALTIME, &real);
+    uint64_t mono = now_ns();
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_TIMESTAMPING)
+            continue;
+
+        // ts[0] 是软件时间戳，ts[2] 是硬件时间戳，这里只开了软件的
+        const struct scm_timestamping *tss = (const struct scm_timestamping *)CMSG_DATA(cmsg);
+        uint64_t rx = tss->ts[0].tv_sec * 1000000000ULL + tss->ts[0].tv_nsec;
+        uint64_t now = real.tv_sec * 1000000000ULL + real.tv_nsec;
+        if (rx == 0 || rx > now)
+            break;
+
+        uint64_t rxmono = mono - (now - rx);
+        loop->rxtoread.record(mono - rxmono);
+        // 数据在 epoll_wait 返回之后才到达（同一批里处理到这个 fd 时又来了新报文），不计入 rx->ready
+        if (rxmono <= ready)
+            loop->rxtoready.record(ready - rxmono);
+        break;
+    }
+    return n;
+}
+
+static void *runloop(void *arg)
+{
+    eventloop *loop = (eventloop *)arg;
+    currentloop = loop;
+    loop->tid.store(syscall(SYS_gettid), std::memory_order_relaxed);
+
+    // 计数器只统计打开它的线程，所以要在事件循环线程里打开
+    if (perfenabled)
+        openperf(loop);
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.data.fd = loop->listensock;
+    ev.events = EPOLLIN;
+    epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, loop->listensock, &ev);
+
+    if (loop->metricssock >= 0)
+    {
+        ev.data.fd = loop->metricssock;
+        epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, loop->metricssock, &ev);
+        ev.data.fd = profilewakefd;
+        epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, profilewakefd, &ev);
+    }
+
+    char buffer[BUFSIZE];
+
+    while (1)
+    {
+        struct epoll_event events[MAXEVENTS];
+
+        // 开了共享内存统计时，空闲的循环也要定时醒来发布
+        setphase(loop, PHASE_WAIT, -1);
+        loop->busysince.store(0, std::memory_order_relaxed);
+        int readyfds = epoll_wait(loop->epollfd, events, MAXEVENTS, stats != NULL ? PUBLISHMS : -1);
+        if (readyfds == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll() failed");
+            break;
+        }
+
+        // 这一批事件共同的就绪时间
+        uint64_t ready = now_ns();
+        loop->iteration.store(loop->iteration.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        loop->busysince.store(ready, std::memory_order_relaxed);
+
+        if (stats != NULL && ready - loop->lastpublish >= PUBLISHMS * 1000000ULL)
+        {
+            setphase(loop, PHASE_PUBLISH, -1);
+            publish(loop, ready);
+        }
+
+        if (readyfds > 0)
+        {
+            bump(loop->counters.wakeups);
+            bump(loop->counters.events, readyfds);
+            int b = 0;
+            while (b < BATCHBUCKETS - 1 && (1 << b) < readyfds)
+                b++;
+            bump(loop->counters.batches[b]);
+        }
+
+        for (int i = 0; i < readyfds; i++)
+        {
+            int eventfd = events[i].data.fd;
+
+            if (eventfd == profilewakefd)
+            {
+                setphase(loop, PHASE_METRICS, eventfd);
+                finishprofile(loop);
+                continue;
+            }
+
+            if (eventfd == loop->listensock || eventfd == loop->metricssock)
+            {
+                setphase(loop, PHASE_ACCEPT, eventfd);
+                int clientsock = accept4(eventfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (clientsock < 0)
+                    continue;
+                if (clientsock >= MAXFDS)
+                {
+                    close(clientsock);
+                    continue;
+                }
+
+                conns[clientsock].metrics = eventfd == loop->metricssock;
+                if (!conns[clientsock].metrics)
+                    bump(loop->counters.accepts);
+
+                if (timestamping && !conns[clientsock].metrics)
+                {
+                    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+                    if (setsockopt(clientsock, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) != 0)
+                        perror("setsockopt(SO_TIMESTAMPING)");
+                }
+
+                memset(&ev, 0, sizeof(ev));
+                ev.data.fd = clientsock;
+                ev.events = EPOLLIN;
+                epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, clientsock, &ev);
+                continue;
+            }
+
+            conn *c = &conns[eventfd];
+
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
+            {
+                closeconn(loop, eventfd);
+                continue;
+            }
+
+            if (events[i].events & EPOLLIN)
+            {
+                setphase(loop, PHASE_READ, eventfd);
+                ssize_t isize = timestamping && !c->metrics ? recvstamped(loop, eventfd, buffer, sizeof(buffer), ready)
+                                                            : read(eventfd, buffer, sizeof(buffer));
+                if (isize == 0 || (isize < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+                {
+                    closeconn(loop, eventfd);
+                    continue;
+                }
+
+                if (c->metrics)
+                {
+                    setphase(loop, PHASE_METRICS, eventfd);
+                    if (isize > 0 && handlemetrics(loop, eventfd, buffer, isize) != 0)
+                        closeconn(loop, eventfd);
+                    continue;
+                }
+
+                bump(loop->counters.reads);
+                if (isize < 0)
+                    bump(loop->counters.eagain);
+                else
+                    bump(loop->counters.bytesin, isize);
+
+                if (isize > 0)
+                {
+                    if (c->out.empty())
+                        c->firstbyte = now_ns();
+                    c->out.append(buffer, isize);
+                }
+            }
+
+            if (c->out.empty())
+                continue;
+            setphase(loop, PHASE_FLUSH, eventfd);
+            if (flush(loop, eventfd, ready) != 0)
+                closeconn(loop, eventfd);
+        }
+    }
+
+    return NULL;
+}
+
+static void printhist(const char *name, const histsnapshot &s)
+{
+    printf("%-18s count=%llu p50=%.1fus p90=%.1fus p99=%.1fus p999=%.1fus max=%.1fus\n", name,
+           (unsigned long long)s.total, s.percentile(0.5) / 1e3, s.percentile(0.9) / 1e3,
+           s.percentile(0.99) / 1e3, s.percentile(0.999) / 1e3, s.max / 1e3);
+}
+
+// 把所有线程的直方图合并后输出，不打断任何一个事件循环
+static void report()
+{
+    static histsnapshot ready, first, rxready, rxread;
+    memset(&ready, 0, sizeof(ready));
+    memset(&first, 0, sizeof(first));
+    memset(&rxready, 0, sizeof(rxready));
+    memset(&rxread, 0, sizeof(rxread));
+
+    for (size_t i = 0; i < loops.size(); i++)
+    {
+        ready.add(loops[i]->readytoflush);
+        first.add(loops[i]->firsttoreply);
+        rxready.add(loops[i]->rxtoready);
+        rxread.add(loops[i]->rxtoread);
+        printf("loop %d: %llu replies\n", loops[i]->id,
+               (unsigned long long)loops[i]->readytoflush.total.load(std::memory_order_relaxed));
+    }
+
+    printhist("readiness->flush", ready);
+    printhist("firstbyte->reply", first);
+    if (timestamping)
+    {
+        printhist("rx->ready", rxready);
+        printhist("rx->read", rxread);
+    }
+
+    // 按回复数归一化，回复数和计数器不是同一时刻读的，压测进行中会有一点误差
+    for (size_t i = 0; perfenabled && i < loops.size(); i++)
+    {
+        uint64_t values[NPERF];
+        uint64_t replies = loops[i]->readytoflush.total.load(std::memory_order_relaxed);
+        if (readperf(loops[i], values) != 0 || replies == 0)
+            continue;
+
+        printf("loop %d per reply%s: cycles=%.0f instructions=%.0f ipc=%.2f cache_misses=%.2f branch_misses=%.2f\n",
+               loops[i]->id, loops[i]->perfuseronly ? " (user only)" : "",
+               (double)values[PERF_CYCLES] / replies, (double)values[PERF_INSTRUCTIONS] / replies,
+               values[PERF_CYCLES] > 0 ? (double)values[PERF_INSTRUCTIONS] / values[PERF_CYCLES] : 0.0,
+               (double)values[PERF_CACHEMISSES] / replies, (double)values[PERF_BRANCHMISSES] / replies);
+    }
+    fflush(stdout);
+}
+
+// SIGUSR2：没在采样就开始，正在采样就停止并写文件
+static void toggleprofile()
+{
+    if (startprofile() == 0)
+    {
+        printf("profiling started.\n");
+        fflush(stdout);
+        return;
+    }
+
+    std::string folded;
+    if (stopprofile(folded) != 0)
+        return;
+
+    char path[64];
+    snprintf(path, sizeof(path), "profile-%d.folded", (int)getpid());
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL)
+    {
+        perror("fopen()");
+        return;
+    }
+    fwrite(folded.data(), 1, folded.size(), fp);
+    fclose(fp);
+    printf("profile written to %s.\n", path);
+    fflush(stdout);
+}
+
+// PROFILESIG：/profile/stop 的汇总在主线程里做，做完叫醒 0 号事件循环回复
+static void stopprofileforloop()
+{
+    std::string folded;
+    if (stopprofile(folded) != 0)
+        folded = "not profiling\n";
+
+    {
+        std::lock_guard<std::mutex> guard(resultlock);
+        profileresult.swap(folded);
+        profileresultready = true;
+    }
+
+    uint64_t one = 1;
+    if (write(profilewakefd, &one, sizeof(one)) < 0)
+        perror("write(eventfd)");
+}
+
+int main(int argc, char *argv[])
+{
+    int nloops = 1;
+    int metricsport = 0;
+    const char *statsname = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:m:s:Pw:T")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            nloops = atoi(optarg);
+            break;
+        case 'm':
+            metricsport = atoi(optarg);
+            break;
+        case 's':
+            statsname = optarg;
+            break;
+        case 'P':
+            perfenabled = true;
+            break;
+        case 'T':
+            timestamping = true;
+            break;
+        case 'w':
+            stallthreshold = strtoull(optarg, NULL, 10) * 1000;
+            break;
+        default:
+            nloops = 0;
+            break;
+        }
+    }
+    if (optind != argc - 1 || nloops <= 0 || (statsname != NULL && nloops > MAXLOOPS))
+    {
+        printf("usage: ./epollmetricsserverdemo [-t loops] [-m metricsport] [-s shmname] [-P] [-w stall_us] [-T] port\n");
+        return -1;
+    }
+    int port = atoi(argv[optind]);
+
+    // 在创建线程之前屏蔽这些信号，事件循环线程继承这个掩码，信号只由主线程的 sigwait 接收
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGUSR2);
+    sigaddset(&set, PROFILESIG);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    mainthread = pthread_self();
+
+    if (statsname != NULL && (stats = createstats(statsname, nloops)) == NULL)
+        return -1;
+
+    for (int i = 0; i < nloops; i++)
+    {
+        eventloop *loop = new eventloop();
+        loop->id = i;
+        loop->listensock = initserver(port);
+        if (loop->listensock < 0)
+        {
+            printf("initserver() failed.\n");
+            return -1;
+        }
+        set_nonblocking(loop->listensock);
+
+        loop->metricssock = -1;
+        if (i == 0 && metricsport > 0)
+        {
+            loop->metricssock = initserver(metricsport);
+            if (loop->metricssock < 0)
+            {
+                printf("initserver(%d) failed.\n", metricsport);
+                return -1;
+            }
+            set_nonblocking(loop->metricssock);
+            profilewakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        }
+
+        loop->epollfd = epoll_create1(EPOLL_CLOEXEC);
+        loop->perfleader = -1;
+        loops.push_back(loop);
+    }
+
+    // 先调用一次 backtrace，让它提前加载 libgcc，信号处理函数里就不会再去分配内存
+    void *frame;
+    backtrace(&frame, 1);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_flags = SA_RESTART;
+    sa.sa_handler = onprofsignal;
+    sigaction(SIGPROF, &sa, NULL);
+
+    if (stallthreshold > 0)
+    {
+        sa.sa_handler = onstallsignal;
+        sigaction(STALLSIG, &sa, NULL);
+    }
+
+    for (int i = 0; i < nloops; i++)
+        pthread_create(&loops[i]->thread, NULL, runloop, loops[i]);
+
+    if (stallthreshold > 0)
+    {
+        pthread_t tid;
+        pthread_create(&tid, NULL, watchdog, NULL);
+    }
+
+    printf("port=%d loops=%d, kill -USR1 %d to report latency, kill -USR2 %d to start/stop profiling.\n",
+           port, nloops, (int)getpid(), (int)getpid());
+    fflush(stdout);
+
+    while (1)
+    {
+        int sig;
+        if (sigwait(&set, &sig) != 0)
+            continue;
+        if (sig == SIGUSR1)
+            report();
+        else if (sig == SIGUSR2)
+            toggleprofile();
+        else if (sig == PROFILESIG)
+            stopprofileforloop();
+        else
+            break;
+    }
+
+    // 退出时删掉共享内存，查看端发现 pid 不在了也会自己退出
+    if (statsname != NULL)
+    {
+        char path[256];
+        snprintf(path, sizeof(path), "/%s", statsname);
+        shm_unlink(path);
+    }
+
+    return 0;
+}
+
+// 初始化服务端的监听端口。
+int initserver(int port)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+    {
+        printf("socket() failed.\n");
+        return -1;
+    }
+
+    int opt = 1;
+    unsigned int len = sizeof(opt);
+
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, len);
+    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &opt, len);
+    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &opt, len);
+
+    struct sockaddr_in servaddr;
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    servaddr.sin_port = htons(port);
+
+    if (bind(sock, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0)
+    {
+        printf("bind() failed.\n");
+        close(sock);
+        return -1;
+    }
+
+    if (listen(sock, SOMAXCONN) != 0)
+    {
+        printf("listen() failed.\n");
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
@@ -0,0 +1,550 @@
+/**
+ * 过载保护：准入控制 + 负载削减（load shedding）
+ *
+ * 请求来得比处理得快时，如果什么都不做，队列会无限变长，每个请求的排队时间都超过客户端的超时，
+ * 服务端虽然一直满负荷在干活，干的却都是客户端已经不要了的活，有效吞吐（goodput）跌到接近 0。
+ *
+ * 这个 demo 把 epoll 循环拆成"收请求入队"和"从队列取请求处理"两步，在几个地方限流：
+ *
+ * 1. 连接数上限（-c）：超过时 accept 后立即回复 OVERLOAD 并关闭，拒绝在门口
+ * 2. 排队请求数上限（-q），队列满时按策略（-p）处理新请求：
+ *      failfast    新请求直接回复 OVERLOAD，不进入队列
+ *      dropoldest  丢弃队头最老的请求（它最可能已经超时），新请求入队
+ * 3. CoDel（-C）：按请求在队列里的停留时间而不是队列长度来判断拥塞。
+ *    停留时间连续 INTERVAL 都高于 TARGET 时进入丢弃状态，
+ *    之后每隔 INTERVAL/sqrt(count) 丢一个请求，直到停留时间回到 TARGET 以下
+ *
+ * 被削减的请求都会立即收到 "OVERLOAD\n"，客户端可以马上重试别的实例，而不是干等超时。
+ * 过载时读得慢的客户端 socket 发送缓冲区往往是满的，回复（包括 OVERLOAD）一次没写完时，
+ * 剩下的部分留在连接的输出缓冲区里，改为等 EPOLLOUT，写完才恢复读，回复不会被截断或悄悄丢掉。
+ * 统计里的 deferred 是这样等过 EPOLLOUT 的回复数，lost 是连接出错或断开时没能送达的回复数。
+ * 每个请求的处理用忙等 -s 微秒模拟 CPU 开销，每秒打印一次这一秒内的统计。
+ *
+ * 编译：g++ -std=c++17 -O2 -o epolloverloadserverdemo epolloverloadserverdemo.cpp
+ * 示例：./epolloverloadserverdemo -c 1000 -q 256 -p dropoldest -C -s 200 5005
+ * */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/fcntl.h>
+#include <sys/types.h>
+#include <deque>
+#include <string>
+
+#define MAXEVENTS 1024
+#define MAXFDS 65536
+// CoDel 参数：可接受的排队时间和观察窗口，单位微秒
+#define CODEL_TARGET 5000
+#define CODEL_INTERVAL 100000
+
+int initserver(int port);
+
+static void set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags == -1) {
+    perror("fcntl()");
+    return;
+  }
+  if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    perror("fcntl()");
+  }
+}
+
+static long long now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+enum policy
+{
+    POLICY_FAILFAST,
+    POLICY_DROPOLDEST,
+};
+
+// 排队中的请求
+struct job
+{
+    int fd;
+    unsigned int gen;       // 入队时连接的代数，连接关闭后旧请求作废
+    long long enqueued;     // 入队时间，CoDel 用它计算停留时间
+    std::string data;
+};
+
+static struct
+{
+    int maxconns;
+    size_t maxqueue;
+    enum policy policy;
+    bool codel;
+    long long servicetime;
+} config = {1024, 1024, POLICY_FAILFAST, false, 100};
+
+static struct
+{
+    unsigned long long accepted;
+    unsigned long long rejected;    // 超过连接数上限被拒绝的连接
+    unsigned long long served;
+    unsigned long long failfast;    // 队列满直接拒绝的请求
+    unsigned long long dropped;     // 队列满被挤掉的老请求
+    unsigned long long codeldrops;  // CoDel 丢弃的请求
+    unsigned long long deferred;    // 一次没写完、留在输出缓冲区等 EPOLLOUT 的回复
+    unsigned long long lost;        // 连接出错或断开时没送达的回复（输出缓冲区里剩下的算一次）
+    long long sojourn;              // 本周期内被处理请求的排队时间之和
+} stats;
+
+/**
+ * CoDel 状态（Nichols & Jacobson, "Controlling Queue Delay"）
+ * */
+static struct
+{
+    long long firstabove;   // 停留时间首次超过 TARGET 后，再过一个 INTERVAL 的时刻
+    long long dropnext;     // 丢弃状态下下一次丢弃的时刻
+    unsigned int count;     // 本轮丢弃状态下已经丢了多少
+    bool dropping;
+} codel;
+
+struct conn
+{
+    unsigned int gen;       // 每次关闭加一，用来识别排队中已经作废的请求
+    std::string out;        // 还没写出去的回复
+    size_t outpos;
+};
+
+static struct conn conns[MAXFDS];
+static int epollfd;
+static int activeconns;
+static std::deque<job> queue;
+
+static const char OVERLOAD[] = "OVERLOAD\n";
+
+static void watch(int fd, int op, uint32_t events)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(struct epoll_event));
+    ev.data.fd = fd;
+    ev.events = events;
+    epoll_ctl(epollfd, op, fd, &ev);
+}
+
+static void closeconn(int fd)
+{
+    // 输出缓冲区里还有没送达的回复
+    if (conns[fd].outpos < conns[fd].out.size())
+        stats.lost++;
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+    conns[fd].gen++;
+    conns[fd].out.clear();
+    conns[fd].outpos = 0;
+    activeconns--;
+}
+
+/**
+ * 尽量把输出缓冲区写出去。
+ * 返回 1 全部写完；0 socket 缓冲区满了还有剩余；-1 出错
+ * */
+static int flush(int fd, conn *c)
+{
+    while (c->outpos < c->out.size())
+    {
+        ssize_t n = send(fd, c->out.data() + c->outpos, c->out.size() - c->outpos, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        c->outpos += n;
+    }
+
+    c->out.clear();
+    c->outpos = 0;
+    return 1;
+}
+
+/**
+ * 回复一个请求。前面的回复还没写完时只追加到输出缓冲区，保证顺序；
+ * 否则直接写，写不完的部分放进输出缓冲区，停止读新请求，等 EPOLLOUT。
+ *
+ * 对方已经断开时用 MSG_NOSIGNAL 避免 SIGPIPE。出错时不在这里关闭：dropoldest 挤掉的可能是别的连接的请求，
+ * 它在本轮 epoll_wait 的结果里可能还有事件，这里只 shutdown()，由事件循环收到 EPOLLHUP 时关闭
+ * */
+static void reply(int fd, const char *data, size_t len)
+{
+    conn *c = &conns[fd];
+    if (c->outpos < c->out.size())
+    {
+        c->out.append(data, len);
+        stats.deferred++;
+        return;
+    }
+
+    size_t sent = 0;
+    while (sent < len)
+    {
+        ssize_t n = send(fd, data + sent, len - sent, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (errno == EINTR)
+                continue;
+            stats.lost++;
+            shutdown(fd, SHUT_RDWR);
+            return;
+        }
+        sent += n;
+    }
+    if (sent == len)
+        return;
+
+    c->out.assign(data + sent, len - sent);
+    c->outpos = 0;
+    stats.deferred++;
+    watch(fd, EPOLL_CTL_MOD, EPOLLOUT);
+}
+
+static void overload(const job &j)
+{
+    if (conns[j.fd].gen == j.gen)
+        reply(j.fd, OVERLOAD, sizeof(OVERLOAD) - 1);
+}
+
+static long long controllaw(long long t)
+{
+    return t + (long long)(CODEL_INTERVAL / sqrt((double)codel.count));
+}
+
+/**
+ * 每次出队时调用，根据这个请求的停留时间判断是否应当丢弃
+ * */
+static bool codel_shoulddrop(const job &j, long long now)
+{
+    long long sojourn = now - j.enqueued;
+    bool oktodrop = false;
+
+    if (sojourn < CODEL_TARGET || queue.empty())
+    {
+        // 排队时间正常，或者队列已经排空
+        codel.firstabove = 0;
+    }
+    else if (codel.firstabove == 0)
+    {
+        codel.firstabove = now + CODEL_INTERVAL;
+    }
+    else if (now >= codel.firstabove)
+    {
+        oktodrop = true;
+    }
+
+    if (codel.dropping)
+    {
+        if (!oktodrop)
+        {
+            codel.dropping = false;
+            return false;
+        }
+        if (now >= codel.dropnext)
+        {
+            codel.count++;
+            codel.dropnext = controllaw(codel.dropnext);
+            return true;
+        }
+        return false;
+    }
+
+    if (oktodrop)
+    {
+        codel.dropping = true;
+        // 刚退出丢弃状态不久又进入，从上次的丢弃频率附近开始
+        if (codel.count > 2 && now - codel.dropnext < 16 * CODEL_INTERVAL)
+            codel.count -= 2;
+        else
+            codel.count = 1;
+        codel.dropnext = controllaw(now);
+        return true;
+    }
+
+    return false;
+}
+
+// 新请求入队，队列满时按策略削减
+static void enqueue(int fd, const char *data, size_t len)
+{
+    if (queue.size() >= config.maxqueue)
+    {
+        if (config.policy == POLICY_FAILFAST)
+        {
+            stats.failfast++;
+            reply(fd, OVERLOAD, sizeof(OVERLOAD) - 1);
+            return;
+        }
+
+        stats.dropped++;
+        overload(queue.front());
+        queue.pop_front();
+    }
+
+    job j;
+    j.fd = fd;
+    j.gen = conns[fd].gen;
+    j.enqueued = now_us();
+    j.data.assign(data, len);
+    queue.push_back(std::move(j));
+}
+
+// 处理一个请求：忙等模拟 CPU 开销，然后回显
+static void serve(const job &j)
+{
+    long long until = now_us() + config.servicetime;
+    while (now_us() < until)
+        ;
+
+    if (conns[j.fd].gen == j.gen)
+        reply(j.fd, j.data.data(), j.data.size());
+}
+
+/**
+ * 从队列中取请求处理，最多处理 budget 微秒后返回，让事件循环有机会收新请求
+ * */
+static void drain(long long budget)
+{
+    long long deadline = now_us() + budget;
+
+    while (!queue.empty())
+    {
+        long long now = now_us();
+        if (now >= deadline)
+            break;
+
+        job j = std::move(queue.front());
+        queue.pop_front();
+
+        // 连接已经关闭，不占用处理时间
+        if (conns[j.fd].gen != j.gen)
+            continue;
+
+        if (config.codel && codel_shoulddrop(j, now))
+        {
+            stats.codeldrops++;
+            overload(j);
+            continue;
+        }
+
+        stats.served++;
+        stats.sojourn += now - j.enqueued;
+        serve(j);
+    }
+}
+
+static void report()
+{
+    printf("conns=%d accepted=%llu rejected=%llu | queue=%zu served=%llu failfast=%llu dropped=%llu codel=%llu"
+           " | deferred=%llu lost=%llu avgsojourn=%lldus\n",
+           activeconns, stats.accepted, stats.rejected, queue.size(), stats.served,
+           stats.failfast, stats.dropped, stats.codeldrops, stats.deferred, stats.lost,
+           stats.served > 0 ? stats.sojourn / (long long)stats.served : 0);
+    fflush(stdout);
+
+    stats = {};
+}
+
+static int usage()
+{
+    printf("usage: ./epolloverloadserverdemo [-c maxconns] [-q maxqueue] [-p failfast|dropoldest] [-C] [-s service_us] port\n");
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "c:q:p:Cs:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            config.maxconns = atoi(optarg);
+            break;
+        case 'q':
+            config.maxqueue = atol(optarg);
+            break;
+        case 'p':
+            if (strcmp(optarg, "failfast") == 0)
+                config.policy = POLICY_FAILFAST;
+            else if (strcmp(optarg, "dropoldest") == 0)
+                config.policy = POLICY_DROPOLDEST;
+            else
+                return usage();
+            break;
+        case 'C':
+            config.codel = true;
+            break;
+        case 's':
+            config.servicetime = atol(optarg);
+            break;
+        default:
+            return usage();
+        }
+    }
+
+    if (optind != argc - 1)
+        return usage();
+
+    // 用于监听的 socket
+    int listensock = initserver(atoi(argv[optind]));
+    if (listensock < 0)
+    {
+        printf("initserver() failed.\n");
+        return -1;
+    }
+    printf("listensock=%d maxconns=%d maxqueue=%zu policy=%s codel=%s service=%lldus\n",
+           listensock, config.maxconns, config.maxqueue,
+           config.policy == POLICY_FAILFAST ? "failfast" : "dropoldest",
+           config.codel ? "on" : "off", config.servicetime);
+
+    epollfd = epoll_create(1);
+
+    watch(listensock, EPOLL_CTL_ADD, EPOLLIN);
+
+    long long nextreport = now_us() + 1000000;
+
+    while (1)
+    {
+        struct epoll_event events[MAXEVENTS];
+
+        // 队列里还有活时不阻塞，只收一下新到的事件
+        int timeout = queue.empty() ? 1000 : 0;
+        int readyfds = epoll_wait(epollfd, events, MAXEVENTS, timeout);
+        if (readyfds == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll() failed");
+            break;
+        }
+
+        for (int i = 0; i < readyfds; i++)
+        {
+            int fd = events[i].data.fd;
+
+            if (fd == listensock)
+            {
+                int clientsock = accept(listensock, NULL, NULL);
+                if (clientsock < 0)
+                {
+                    printf("accept() failed.\n");
+                    continue;
+                }
+
+                // 连接数已满，在门口拒绝。马上就要关闭，没法等 EPOLLOUT，写不进去的只能计入 lost
+                if (clientsock >= MAXFDS || activeconns >= config.maxconns)
+                {
+                    stats.rejected++;
+                    if (send(clientsock, OVERLOAD, sizeof(OVERLOAD) - 1, MSG_NOSIGNAL) != sizeof(OVERLOAD) - 1)
+                        stats.lost++;
+                    close(clientsock);
+                    continue;
+                }
+
+                stats.accepted++;
+                activeconns++;
+                set_nonblocking(clientsock);
+                watch(clientsock, EPOLL_CTL_ADD, EPOLLIN);
+                continue;
+            }
+
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
+            {
+                closeconn(fd);
+                continue;
+            }
+
+            // 之前的回复没写完，socket 可写了继续写，写完才恢复读
+            if (events[i].events & EPOLLOUT)
+            {
+                int r = flush(fd, &conns[fd]);
+                if (r < 0)
+                    closeconn(fd);
+                else if (r > 0)
+                    watch(fd, EPOLL_CTL_MOD, EPOLLIN);
+                continue;
+            }
+
+            char buffer[1024];
+            ssize_t isize = read(fd, buffer, sizeof(buffer));
+            if (isize <= 0)
+            {
+                if (isize < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    continue;
+                closeconn(fd);
+                continue;
+            }
+
+            enqueue(fd, buffer, isize);
+        }
+
+        // 每轮最多处理 10ms，避免积压时长时间不去 epoll_wait
+        drain(10000);
+
+        if (now_us() >= nextreport)
+        {
+            report();
+            nextreport += 1000000;
+        }
+    }
+
+    close(epollfd);
+
+    return 0;
+}
+
+// 初始化服务端的监听端口。
+int initserver(int port)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+    {
+        printf("socket() failed.\n");
+        return -1;
+    }
+
+    int opt = 1;
+    unsigned int len = sizeof(opt);
+
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, len);
+    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &opt, len);
+
+    struct sockaddr_in servaddr;
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    servaddr.sin_port = htons(port);
+
+    if (bind(sock, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0)
+    {
+        printf("bind() failed.\n");
+        close(sock);
+        return -1;
+    }
+
+    if (listen(sock, SOMAXCONN) != 0)
+    {
+        printf("listen() failed.\n");
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
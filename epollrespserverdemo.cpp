@@ -0,0 +1,597 @@
+/**
+ * 兼容 RESP（Redis 协议）的流水线服务端
+ *
+ * 流水线（pipelining）是指客户端不等回复就连续发出多条命令，一次 read() 里往往包含几十上百条命令。
+ * 服务端要做到：
+ * 1. 一次 read 之后循环解析，直到剩下不完整的命令为止，半条命令留在输入缓冲区等下次
+ * 2. 按顺序执行命令，回复依次追加到连接的输出缓冲区
+ * 3. 本批命令全部处理完后才 write 一次，而不是每条命令一次系统调用
+ *
+ * 支持两种请求格式：
+ *     *2\r\n$3\r\nGET\r\n$3\r\nkey\r\n     多条批量字符串组成的数组（客户端库、redis-benchmark 使用）
+ *     GET key\r\n                          内联命令（telnet、redis-benchmark 的 PING_INLINE），按空格切分，不支持引号
+ *
+ * 命令：PING ECHO SET GET DEL EXISTS INCR COMMAND CONFIG QUIT
+ *
+ * 每条命令的参数数组都从一个单调分配的 arena（std::pmr::monotonic_buffer_resource）里分配，
+ * 分配只是移动指针，不逐个释放；回复追加到输出缓冲区之后整个 arena 一次 release()。
+ * arena 先用一块静态的初始缓冲区，不够时向池（std::pmr::unsynchronized_pool_resource）要更大的块，
+ * release() 把这些块还给池，下一条大命令直接复用，稳态下不再调用 malloc。
+ *
+ * 用 redis-benchmark 测流水线收益：
+ *     redis-benchmark -p 6380 -t ping,set,get -n 1000000 -P 1
+ *     redis-benchmark -p 6380 -t ping,set,get -n 1000000 -P 64
+ *
+ * 编译：g++ -std=c++20 -O2 -o epollrespserverdemo epollrespserverdemo.cpp
+ * */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/fcntl.h>
+#include <sys/types.h>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#define MAXEVENTS 1024
+#define MAXFDS 65536
+// 输入缓冲区的初始大小
+#define INBUFSIZE (64 * 1024)
+// 单个参数和参数个数的上限，防止恶意请求撑爆内存
+#define MAXBULK (64 * 1024 * 1024)
+#define MAXARGS (1024 * 1024)
+#define MAXINLINE (64 * 1024)
+// 每条命令的 arena 的初始缓冲区，普通命令在这里面就够用
+#define ARENASIZE (16 * 1024)
+
+int initserver(int port);
+
+static void set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags == -1) {
+    perror("fcntl()");
+    return;
+  }
+  if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    perror("fcntl()");
+  }
+}
+
+struct conn
+{
+    // 输入缓冲区：[rpos, wpos) 是已读入但尚未解析的数据
+    char *buf;
+    size_t cap;
+    size_t rpos;
+    size_t wpos;
+    // 输出缓冲区：一批命令的回复全部追加到这里再统一发送
+    std::string out;
+    size_t outpos;
+    bool closing;   // QUIT 之后发完回复就关闭
+};
+
+static conn conns[MAXFDS];
+
+// 键值存储，用 string_view 直接查找，不为查询临时构造 std::string
+struct strhash
+{
+    using is_transparent = void;
+    size_t operator()(std::string_view s) const { return std::hash<std::string_view>()(s); }
+};
+
+static std::unordered_map<std::string, std::string, strhash, std::equal_to<>> store;
+
+/**
+ * 在 [p, end) 中找 "\r\n"，返回 '\r' 的位置，找不到返回 NULL
+ * */
+static const char *findcrlf(const char *p, const char *end)
+{
+    while (p < end)
+    {
+        const char *cr = (const char *)memchr(p, '\r', end - p);
+        if (cr == NULL || cr + 1 >= end)
+            return NULL;
+        if (cr[1] == '\n')
+            return cr;
+        p = cr + 1;
+    }
+    return NULL;
+}
+
+// 解析 "\r\n" 结尾的十进制整数，成功返回 0
+static int parseint(const char *p, const char *end, long long *value)
+{
+    bool neg = false;
+    if (p < end && *p == '-')
+    {
+        neg = true;
+        p++;
+    }
+    if (p == end)
+        return -1;
+
+    long long v = 0;
+    for (; p < end; p++)
+    {
+        if (*p < '0' || *p > '9' || v > (1LL << 50))
+            return -1;
+        v = v * 10 + (*p - '0');
+    }
+    *value = neg ? -v : v;
+    return 0;
+}
+
+/**
+ * 从 [p, p+n) 解析一条命令，参数以 string_view 的形式指向输入缓冲区。
+ * 返回值：>0 本条命令占用的字节数；0 数据不完整；-1 协议错误
+ * */
+static long parsecommand(const char *p, size_t n, std::pmr::vector<std::string_view> &argv)
+{
+    const char *start = p;
+    const char *end = p + n;
+    argv.clear();
+
+    if (n == 0)
+        return 0;
+
+    // 内联命令
+    if (*p != '*')
+    {
+        const char *cr = findcrlf(p, end);
+        if (cr == NULL)
+            return n > MAXINLINE ? -1 : 0;
+
+        const char *q = p;
+        while (q < cr)
+        {
+            while (q < cr && *q == ' ')
+                q++;
+            const char *w = q;
+            while (q < cr && *q != ' ')
+                q++;
+            if (q > w)
+                argv.emplace_back(w, q - w);
+        }
+        return cr + 2 - start;
+    }
+
+    const char *cr = findcrlf(p, end);
+    if (cr == NULL)
+        return 0;
+
+    long long nargs;
+    if (parseint(p + 1, cr, &nargs) != 0 || nargs > MAXARGS)
+        return -1;
+    p = cr + 2;
+
+    // 空数组 *0 和空值数组 *-1 和 Redis 一样当作空命令跳过，argv 为空，dispatch 什么也不做
+    if (nargs <= 0)
+        return p - start;
+
+    // 每个参数至少 6 字节（"$0\r\n\r\n"），不按请求头里声称的个数预留，免得还没收到数据就先占一大块内存
+    argv.reserve(nargs < (end - p) / 6 ? nargs : (end - p) / 6);
+
+    for (long long i = 0; i < nargs; i++)
+    {
+        cr = findcrlf(p, end);
+        if (cr == NULL)
+            return 0;
+        if (*p != '$')
+            return -1;
+
+        long long len;
+        if (parseint(p + 1, cr, &len) != 0 || len < 0 || len > MAXBULK)
+            return -1;
+        p = cr + 2;
+
+        if (end - p < len + 2)
+            return 0;
+        if (p[len] != '\r' || p[len + 1] != '\n')
+            return -1;
+
+        argv.emplace_back(p, len);
+        p += len + 2;
+    }
+
+    return p - start;
+}
+
+// 以下是回复的编码，全部追加到连接的输出缓冲区
+static void addstatus(conn *c, const char *s)
+{
+    c->out += '+';
+    c->out += s;
+    c->out += "\r\n";
+}
+
+static void adderror(conn *c, const char *s)
+{
+    c->out += "-ERR ";
+    c->out += s;
+    c->out += "\r\n";
+}
+
+static void addint(conn *c, long long v)
+{
+    char line[32];
+    int n = snprintf(line, sizeof(line), ":%lld\r\n", v);
+    c->out.append(line, n);
+}
+
+static void addbulk(conn *c, std::string_view s)
+{
+    char line[32];
+    int n = snprintf(line, sizeof(line), "$%zu\r\n", s.size());
+    c->out.append(line, n);
+    c->out.append(s);
+    c->out += "\r\n";
+}
+
+static void addnil(conn *c)
+{
+    c->out += "$-1\r\n";
+}
+
+static bool iscmd(std::string_view arg, const char *name)
+{
+    return arg.size() == strlen(name) && strncasecmp(arg.data(), name, arg.size()) == 0;
+}
+
+// 执行一条命令
+static void dispatch(conn *c, const std::pmr::vector<std::string_view> &argv)
+{
+    if (argv.empty())
+        return;
+
+    std::string_view cmd = argv[0];
+    size_t argc = argv.size();
+
+    if (iscmd(cmd, "PING"))
+    {
+        if (argc > 1)
+            addbulk(c, argv[1]);
+        else
+            addstatus(c, "PONG");
+    }
+    else if (iscmd(cmd, "ECHO") && argc == 2)
+    {
+        addbulk(c, argv[1]);
+    }
+    else if (iscmd(cmd, "SET") && argc >= 3)
+    {
+        auto it = store.find(argv[1]);
+        if (it != store.end())
+            it->second.assign(argv[2]);
+        else
+            store.emplace(argv[1], argv[2]);
+        addstatus(c, "OK");
+    }
+    else if (iscmd(cmd, "GET") && argc == 2)
+    {
+        auto it = store.find(argv[1]);
+        if (it != store.end())
+            addbulk(c, it->second);
+        else
+            addnil(c);
+    }
+    else if ((iscmd(cmd, "DEL") || iscmd(cmd, "EXISTS")) && argc >= 2)
+    {
+        bool del = iscmd(cmd, "DEL");
+        long long count = 0;
+        for (size_t i = 1; i < argc; i++)
+        {
+            auto it = store.find(argv[i]);
+            if (it == store.end())
+                continue;
+            count++;
+            if (del)
+                store.erase(it);
+        }
+        addint(c, count);
+    }
+    else if (iscmd(cmd, "INCR") && argc == 2)
+    {
+        auto it = store.find(argv[1]);
+        if (it == store.end())
+            it = store.emplace(argv[1], "0").first;
+
+        long long v;
+        if (parseint(it->second.data(), it->second.data() + it->second.size(), &v) != 0)
+        {
+            adderror(c, "value is not an integer or out of range");
+            return;
+        }
+        it->second = std::to_string(++v);
+        addint(c, v);
+    }
+    else if (iscmd(cmd, "COMMAND") || iscmd(cmd, "CONFIG"))
+    {
+        // redis-benchmark 启动时会查询配置，返回空数组即可
+        c->out += "*0\r\n";
+    }
+    else if (iscmd(cmd, "QUIT"))
+    {
+        addstatus(c, "OK");
+        c->closing = true;
+    }
+    else
+    {
+        adderror(c, "unknown command or wrong number of arguments");
+    }
+}
+
+/**
+ * 尽量把输出缓冲区写出去。
+ * 返回 1 全部写完；0 socket 缓冲区满了还有剩余；-1 出错
+ * */
+static int flush(int fd, conn *c)
+{
+    while (c->outpos < c->out.size())
+    {
+        ssize_t n = write(fd, c->out.data() + c->outpos, c->out.size() - c->outpos);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        c->outpos += n;
+    }
+
+    c->out.clear();
+    c->outpos = 0;
+    return 1;
+}
+
+static void watch(int epollfd, int fd, int op, uint32_t events)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(struct epoll_event));
+    ev.data.fd = fd;
+    ev.events = events;
+    epoll_ctl(epollfd, op, fd, &ev);
+}
+
+static void closeconn(int epollfd, int fd)
+{
+    printf("client(eventfd=%d) disconnected.\n", fd);
+
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+
+    conn *c = &conns[fd];
+    c->rpos = 0;
+    c->wpos = 0;
+    c->out.clear();
+    c->outpos = 0;
+    c->closing = false;
+}
+
+/**
+ * 解析并执行一条命令，返回值同 parsecommand。参数数组在 arena 上，随 arena 一起释放
+ * */
+static long execute(conn *c, std::pmr::memory_resource *arena)
+{
+    std::pmr::vector<std::string_view> argv(arena);
+    long used = parsecommand(c->buf + c->rpos, c->wpos - c->rpos, argv);
+    if (used > 0)
+        dispatch(c, argv);
+    return used;
+}
+
+/**
+ * 解析并执行输入缓冲区中所有完整的命令。返回 -1 表示协议错误
+ * */
+static int process(conn *c)
+{
+    // 超过 1MB 的块不进池，直接向系统申请和归还
+    static std::pmr::unsynchronized_pool_resource pool(std::pmr::pool_options{0, 1024 * 1024});
+    static char initial[ARENASIZE];
+    static std::pmr::monotonic_buffer_resource arena(initial, sizeof(initial), &pool);
+
+    while (c->rpos < c->wpos)
+    {
+        long used = execute(c, &arena);
+        // 回复已经追加到输出缓冲区，这条命令的临时数据一次性丢掉
+        arena.release();
+        if (used < 0)
+        {
+            adderror(c, "Protocol error");
+            c->closing = true;
+            return -1;
+        }
+        if (used == 0)
+            break;
+
+        c->rpos += used;
+
+        if (c->closing)
+            break;
+    }
+
+    // 剩下的半条命令挪到缓冲区开头，缓冲区满了就扩容
+    size_t pending = c->wpos - c->rpos;
+    if (c->rpos > 0)
+    {
+        memmove(c->buf, c->buf + c->rpos, pending);
+        c->rpos = 0;
+        c->wpos = pending;
+    }
+    if (c->wpos == c->cap)
+    {
+        c->cap *= 2;
+        c->buf = (char *)realloc(c->buf, c->cap);
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        printf("usage: ./epollrespserverdemo port\n");
+        return -1;
+    }
+
+    // 用于监听的 socket
+    int listensock = initserver(atoi(argv[1]));
+    if (listensock < 0)
+    {
+        printf("initserver() failed.\n");
+        return -1;
+    }
+    printf("listensock=%d\n", listensock);
+
+    int epollfd = epoll_create(1);
+
+    watch(epollfd, listensock, EPOLL_CTL_ADD, EPOLLIN);
+
+    while (1)
+    {
+        struct epoll_event events[MAXEVENTS];
+
+        int readyfds = epoll_wait(epollfd, events, MAXEVENTS, -1);
+        if (readyfds == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll() failed");
+            break;
+        }
+
+        for (int i = 0; i < readyfds; i++)
+        {
+            int fd = events[i].data.fd;
+
+            // 新的客户端连接
+            if (fd == listensock)
+            {
+                int clientsock = accept(listensock, NULL, NULL);
+                if (clientsock < 0)
+                {
+                    printf("accept() failed.\n");
+                    continue;
+                }
+                if (clientsock >= MAXFDS)
+                {
+                    close(clientsock);
+                    continue;
+                }
+
+                printf("client(socket=%d) connected ok.\n", clientsock);
+
+                set_nonblocking(clientsock);
+                conn *c = &conns[clientsock];
+                if (c->buf == NULL)
+                {
+                    c->buf = (char *)malloc(INBUFSIZE);
+                    c->cap = INBUFSIZE;
+                }
+                watch(epollfd, clientsock, EPOLL_CTL_ADD, EPOLLIN);
+                continue;
+            }
+
+            conn *c = &conns[fd];
+
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
+            {
+                closeconn(epollfd, fd);
+                continue;
+            }
+
+            // 上一批回复没写完，socket 可写了继续写
+            if (events[i].events & EPOLLOUT)
+            {
+                int r = flush(fd, c);
+                if (r < 0 || (r == 1 && c->closing))
+                {
+                    closeconn(epollfd, fd);
+                    continue;
+                }
+                if (r == 1)
+                    watch(epollfd, fd, EPOLL_CTL_MOD, EPOLLIN);
+            }
+
+            if (!(events[i].events & EPOLLIN) || c->closing)
+                continue;
+
+            ssize_t isize = read(fd, c->buf + c->wpos, c->cap - c->wpos);
+            if (isize <= 0)
+            {
+                if (isize < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    continue;
+                closeconn(epollfd, fd);
+                continue;
+            }
+            c->wpos += isize;
+
+            bool hadpending = c->outpos < c->out.size();
+            process(c);
+
+            // 整批命令的回复只发一次；还在等 EPOLLOUT 的话不用着急写
+            if (hadpending)
+                continue;
+
+            int r = flush(fd, c);
+            if (r < 0 || (r == 1 && c->closing))
+                closeconn(epollfd, fd);
+            else if (r == 0)
+                watch(epollfd, fd, EPOLL_CTL_MOD, EPOLLIN | EPOLLOUT);
+        }
+    }
+
+    close(epollfd);
+
+    return 0;
+}
+
+// 初始化服务端的监听端口。
+int initserver(int port)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+    {
+        printf("socket() failed.\n");
+        return -1;
+    }
+
+    int opt = 1;
+    unsigned int len = sizeof(opt);
+
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, len);
+    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &opt, len);
+
+    struct sockaddr_in servaddr;
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    servaddr.sin_port = htons(port);
+
+    if (bind(sock, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0)
+    {
+        printf("bind() failed.\n");
+        close(sock);
+        return -1;
+    }
+
+    if (listen(sock, SOMAXCONN) != 0)
+    {
+        printf("listen() failed.\n");
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
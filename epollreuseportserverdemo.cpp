@@ -0,0 +1,581 @@
+/**
+ * 多事件循环 + SO_REUSEPORT + CPU 绑定 + NUMA 本地内存
+ *
+ * 单个 epoll 线程用满一个核之后，常见做法是开多个事件循环线程，每个线程一个 epoll 实例。
+ * SO_REUSEPORT 允许多个 socket bind 同一个端口，每个线程有自己的监听 socket 和 accept 队列，
+ * 内核按四元组哈希把新连接分给其中一个，线程之间不共享任何东西。
+ *
+ * 但线程如果不绑核，调度器会把它在核之间挪来挪去，缓存全部失效；
+ * 在多路服务器上，线程的连接数组和读写缓冲区如果分配在另一个 NUMA 节点的内存上，每次访问都要跨 QPI/UPI。所以：
+ *
+ * -C cpulist  每个事件循环线程绑定到列表中的一个 CPU（例如 0-3,8,10）
+ * -N          线程绑核之后再分配自己的连接 slab（连接结构体 + 读缓冲区），并用 mbind 绑定到本 CPU 所在的 NUMA 节点；
+ *             不加 -N 时由主线程统一分配，用来对比
+ * -I ifname   没有给 -C 时，从 /sys/class/net/<ifname>/device/local_cpulist 读取网卡所在 NUMA 节点的 CPU，
+ *             让事件循环和处理网卡中断的 CPU 靠在一起
+ * -t n        事件循环线程数，默认等于 CPU 列表的长度
+ * -B          在 reuseport 组上挂一段 classic BPF 程序（SO_ATTACH_REUSEPORT_CBPF），
+ *             不再按四元组哈希，而是把连接交给绑定在“处理这个连接收包软中断的 CPU”上的那个事件循环，
+ *             这样连接的 socket 和刚收到的数据都还热在这个核的缓存里。
+ *             配合 RSS/RPS 把不同连接的中断分散到这些 CPU 上才有意义
+ *
+ * 每 5 秒打印每个事件循环的指标，用来验证局部性：
+ *     cpu/node     绑定的 CPU 和它所在的节点
+ *     migrations   循环中发现自己不在绑定 CPU 上的次数（应当为 0）
+ *     remote       slab 中位于其他 NUMA 节点的页数（-N 时应当为 0）
+ *     share        本循环接收的连接占全部连接的比例，看负载分布
+ *     cpumatch     accept 后用 SO_INCOMING_CPU 查到的收包 CPU 与本循环绑定的 CPU 一致的连接数（-B 时应当等于 accepts）
+ *
+ * 编译：g++ -std=c++17 -O2 -pthread -o epollreuseportserverdemo epollreuseportserverdemo.cpp
+ * 示例：./epollreuseportserverdemo -C 0-3 -N -B 5005
+ * */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/filter.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/fcntl.h>
+#include <sys/types.h>
+#include <atomic>
+#include <vector>
+
+#define MAXEVENTS 1024
+// 每个事件循环的连接数上限和每个连接的读缓冲区大小
+#define MAXCONNS 4096
+#define BUFSIZE 4096
+#define REPORTINTERVAL 5
+
+// 不依赖 libnuma，直接用系统调用，常量取自 <numaif.h>
+#define MPOL_BIND 2
+#define MPOL_F_NODE (1 << 0)
+#define MPOL_F_ADDR (1 << 1)
+#define MAXNODES 1024
+
+int initserver(int port);
+
+static void set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags == -1) {
+    perror("fcntl()");
+    return;
+  }
+  if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    perror("fcntl()");
+  }
+}
+
+// 连接 slab 中的一项，空闲时通过 next 串成链表
+struct conn
+{
+    int fd;
+    conn *next;
+    char buf[BUFSIZE];
+};
+
+/**
+ * 每个事件循环的指标。只有所属线程写，报告线程用 relaxed 读；
+ * 按 cache line 对齐，避免相邻两个循环的计数互相伪共享
+ * */
+struct alignas(64) loopstats
+{
+    std::atomic<unsigned long long> iterations;
+    std::atomic<unsigned long long> accepts;
+    std::atomic<unsigned long long> messages;
+    std::atomic<unsigned long long> bytes;
+    std::atomic<unsigned long long> migrations;
+    std::atomic<unsigned long long> cpumatch;
+    std::atomic<int> active;
+};
+
+struct eventloop
+{
+    int id;
+    int cpu;            // 绑定的 CPU，-1 表示不绑定
+    int node;           // CPU 所在的 NUMA 节点
+    int listensock;
+    conn *slab;
+    conn *freelist;
+    loopstats stats;
+    // -N 时 node 和 slab 由事件循环线程在绑核之后写入，写完用 release 置位，
+    // 报告线程 acquire 读到 true 之后才能读这两个字段
+    std::atomic<bool> ready;
+};
+
+static struct
+{
+    std::vector<int> cpus;
+    bool numalocal;
+    bool steer;
+    int nloops;
+    int port;
+} config;
+
+static void bump(std::atomic<unsigned long long> &counter, unsigned long long n = 1)
+{
+    // 只有一个写者，不需要原子的读-改-写
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+/**
+ * 解析 "0-3,8,10-11" 格式的 CPU 列表，与 /sys 下 cpulist 文件的格式相同
+ * */
+static int parsecpulist(const char *s, std::vector<int> *cpus)
+{
+    while (*s != '\0' && *s != '\n')
+    {
+        char *end;
+        long first = strtol(s, &end, 10);
+        if (end == s)
+            return -1;
+        long last = first;
+        if (*end == '-')
+        {
+            s = end + 1;
+            last = strtol(s, &end, 10);
+            if (end == s || last < first)
+                return -1;
+        }
+        for (long c = first; c <= last; c++)
+            cpus->push_back((int)c);
+
+        s = end;
+        if (*s == ',')
+            s++;
+    }
+    return cpus->empty() ? -1 : 0;
+}
+
+// 读出网卡所在 NUMA 节点的 CPU 列表
+static int nic_cpulist(const char *ifname, std::vector<int> *cpus)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/local_cpulist", ifname);
+
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        printf("%s not found, %s is probably a virtual interface.\n", path, ifname);
+        return -1;
+    }
+
+    char line[1024];
+    int ret = fgets(line, sizeof(line), fp) != NULL ? parsecpulist(line, cpus) : -1;
+    fclose(fp);
+    return ret;
+}
+
+static int currentnode()
+{
+    unsigned int cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+        return 0;
+    return node;
+}
+
+/**
+ * 分配连接 slab。numalocal 时绑定到 node 上，并在本线程里逐页写一遍，让物理页现在就分配好
+ * */
+static conn *allocslab(int node, bool numalocal)
+{
+    size_t size = sizeof(conn) * MAXCONNS;
+    conn *slab = (conn *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slab == MAP_FAILED)
+        return NULL;
+
+    if (numalocal)
+    {
+        unsigned long nodemask[MAXNODES / (8 * sizeof(unsigned long))] = {0};
+        nodemask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+        if (syscall(SYS_mbind, slab, size, MPOL_BIND, nodemask, MAXNODES, 0) != 0)
+            perror("mbind()");
+    }
+
+    memset(slab, 0, size);
+    return slab;
+}
+
+// 统计 slab 中不在 node 上的页数
+static int remotepages(conn *slab, int node)
+{
+    size_t size = sizeof(conn) * MAXCONNS;
+    long pagesize = sysconf(_SC_PAGESIZE);
+    int remote = 0;
+
+    for (size_t off = 0; off < size; off += pagesize)
+    {
+        int pagenode = -1;
+        if (syscall(SYS_get_mempolicy, &pagenode, NULL, 0, (char *)slab + off, MPOL_F_NODE | MPOL_F_ADDR) != 0)
+            return -1;
+        if (pagenode != node)
+            remote++;
+    }
+    return remote;
+}
+
+/**
+ * 生成 reuseport 选择程序。返回值是 socket 在 reuseport 组中的下标，也就是 bind 的先后顺序，
+ * 这里正好等于事件循环的编号：
+ *
+ *     ld  #cpu                  A = 处理当前报文的 CPU
+ *     jeq #cpus[0], ret #0
+ *     jeq #cpus[1], ret #1
+ *     ...
+ *     mod #nloops               不在列表中的 CPU 退回取模
+ *     ret a
+ *
+ * 多个事件循环绑定在同一个 CPU 上时，只有第一个会被选中
+ * */
+static std::vector<struct sock_filter> steerprogram(const std::vector<eventloop> &loops)
+{
+    std::vector<struct sock_filter> prog;
+    prog.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (__u32)(SKF_AD_OFF + SKF_AD_CPU)));
+
+    for (size_t i = 0; i < loops.size(); i++)
+    {
+        if (loops[i].cpu < 0)
+            continue;
+        // 相等时跳过 0 条执行下一条的 ret，不等时跳过 ret
+        prog.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (__u32)loops[i].cpu, 0, 1));
+        prog.push_back(BPF_STMT(BPF_RET | BPF_K, (__u32)i));
+    }
+
+    prog.push_back(BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (__u32)loops.size()));
+    prog.push_back(BPF_STMT(BPF_RET | BPF_A, 0));
+    return prog;
+}
+
+static int attachsteering(std::vector<eventloop> &loops)
+{
+    std::vector<struct sock_filter> prog = steerprogram(loops);
+    if (prog.size() > BPF_MAXINSNS)
+    {
+        printf("too many loops for a cBPF program.\n");
+        return -1;
+    }
+
+    struct sock_fprog fprog;
+    fprog.len = prog.size();
+    fprog.filter = prog.data();
+
+    // 挂在组内任意一个 socket 上即对整个组生效
+    if (setsockopt(loops[0].listensock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &fprog, sizeof(fprog)) != 0)
+    {
+        perror("setsockopt(SO_ATTACH_REUSEPORT_CBPF)");
+        return -1;
+    }
+    return 0;
+}
+
+static void initfreelist(eventloop *loop)
+{
+    loop->freelist = NULL;
+    for (int i = MAXCONNS - 1; i >= 0; i--)
+    {
+        loop->slab[i].next = loop->freelist;
+        loop->freelist = &loop->slab[i];
+    }
+}
+
+static void closeconn(eventloop *loop, int epollfd, conn *c)
+{
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->next = loop->freelist;
+    loop->freelist = c;
+    loop->stats.active.store(loop->stats.active.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+}
+
+static void *runloop(void *arg)
+{
+    eventloop *loop = (eventloop *)arg;
+
+    if (loop->cpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(loop->cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err != 0)
+            printf("loop %d: pthread_setaffinity_np(cpu=%d) failed: %s\n", loop->id, loop->cpu, strerror(err));
+    }
+
+    // 绑核之后才能确定本线程所在的节点，slab 也要在这之后分配
+    loop->node = currentnode();
+    if (config.numalocal)
+    {
+        loop->slab = allocslab(loop->node, true);
+        if (loop->slab == NULL)
+        {
+            perror("mmap()");
+            exit(1);
+        }
+        initfreelist(loop);
+    }
+    loop->ready.store(true, std::memory_order_release);
+
+    int epollfd = epoll_create1(EPOLL_CLOEXEC);
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.data.ptr = NULL;     // data.ptr 为 NULL 表示监听 socket
+    ev.events = EPOLLIN;
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, loop->listensock, &ev);
+
+    while (1)
+    {
+        struct epoll_event events[MAXEVENTS];
+
+        int readyfds = epoll_wait(epollfd, events, MAXEVENTS, -1);
+        if (readyfds == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll() failed");
+            break;
+        }
+
+        bump(loop->stats.iterations);
+        if (loop->cpu >= 0 && sched_getcpu() != loop->cpu)
+            bump(loop->stats.migrations);
+
+        for (int i = 0; i < readyfds; i++)
+        {
+            conn *c = (conn *)events[i].data.ptr;
+
+            // 新的客户端连接
+            if (c == NULL)
+            {
+                int clientsock = accept4(loop->listensock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (clientsock < 0)
+                    continue;
+
+                if (loop->freelist == NULL)
+                {
+                    close(clientsock);
+                    continue;
+                }
+
+                c = loop->freelist;
+                loop->freelist = c->next;
+                c->fd = clientsock;
+
+                bump(loop->stats.accepts);
+
+                int incoming = -1;
+                socklen_t optlen = sizeof(incoming);
+                if (getsockopt(clientsock, SOL_SOCKET, SO_INCOMING_CPU, &incoming, &optlen) == 0 && incoming == loop->cpu)
+                    bump(loop->stats.cpumatch);
+                loop->stats.active.store(loop->stats.active.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+                memset(&ev, 0, sizeof(ev));
+                ev.data.ptr = c;
+                ev.events = EPOLLIN;
+                epoll_ctl(epollfd, EPOLL_CTL_ADD, clientsock, &ev);
+                continue;
+            }
+
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
+            {
+                closeconn(loop, epollfd, c);
+                continue;
+            }
+
+            ssize_t isize = read(c->fd, c->buf, sizeof(c->buf));
+            if (isize <= 0)
+            {
+                if (isize < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    continue;
+                closeconn(loop, epollfd, c);
+                continue;
+            }
+
+            bump(loop->stats.messages);
+            bump(loop->stats.bytes, isize);
+
+            // 把收到的报文发回给客户端。
+            write(c->fd, c->buf, isize);
+        }
+    }
+
+    close(epollfd);
+    return NULL;
+}
+
+static void report(std::vector<eventloop> &loops)
+{
+    unsigned long long total = 0;
+    for (size_t i = 0; i < loops.size(); i++)
+        total += loops[i].stats.accepts.load(std::memory_order_relaxed);
+
+    printf("loop   cpu  node  active      accepts  share  cpumatch     messages        bytes   iterations  migrations  remote\n");
+    for (size_t i = 0; i < loops.size(); i++)
+    {
+        eventloop *loop = &loops[i];
+        const loopstats &s = loop->stats;
+        if (!loop->ready.load(std::memory_order_acquire))
+            continue;
+        unsigned long long accepts = s.accepts.load(std::memory_order_relaxed);
+        printf("%4d  %4d  %4d  %6d  %11llu  %4.0f%%  %8llu  %11llu  %11llu  %11llu  %10llu  %6d\n",
+               loop->id, loop->cpu, loop->node,
+               s.active.load(std::memory_order_relaxed),
+               accepts, total > 0 ? 100.0 * accepts / total : 0.0,
+               s.cpumatch.load(std::memory_order_relaxed),
+               s.messages.load(std::memory_order_relaxed),
+               s.bytes.load(std::memory_order_relaxed),
+               s.iterations.load(std::memory_order_relaxed),
+               s.migrations.load(std::memory_order_relaxed),
+               remotepages(loop->slab, loop->node));
+    }
+    fflush(stdout);
+}
+
+static int usage()
+{
+    printf("usage: ./epollreuseportserverdemo [-t loops] [-C cpulist] [-N] [-B] [-I ifname] port\n");
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *ifname = NULL;
+    config.nloops = 0;
+    config.numalocal = false;
+    config.steer = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:C:NBI:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            config.nloops = atoi(optarg);
+            break;
+        case 'C':
+            if (parsecpulist(optarg, &config.cpus) != 0)
+                return usage();
+            break;
+        case 'N':
+            config.numalocal = true;
+            break;
+        case 'B':
+            config.steer = true;
+            break;
+        case 'I':
+            ifname = optarg;
+            break;
+        default:
+            return usage();
+        }
+    }
+    if (optind != argc - 1)
+        return usage();
+    config.port = atoi(argv[optind]);
+
+    if (config.cpus.empty() && ifname != NULL && nic_cpulist(ifname, &config.cpus) == 0)
+        printf("using cpus local to %s.\n", ifname);
+
+    if (config.nloops <= 0)
+        config.nloops = config.cpus.empty() ? 1 : (int)config.cpus.size();
+
+    std::vector<eventloop> loops(config.nloops);
+    std::vector<pthread_t> threads(config.nloops);
+
+    for (int i = 0; i < config.nloops; i++)
+    {
+        eventloop *loop = &loops[i];
+        loop->id = i;
+        loop->cpu = config.cpus.empty() ? -1 : config.cpus[i % config.cpus.size()];
+        loop->node = currentnode();
+        loop->ready.store(false, std::memory_order_relaxed);
+
+        // 每个事件循环一个监听 socket，都绑定同一个端口
+        loop->listensock = initserver(config.port);
+        if (loop->listensock < 0)
+        {
+            printf("initserver() failed.\n");
+            return -1;
+        }
+        set_nonblocking(loop->listensock);
+
+        // 不开 -N 时由主线程统一分配，页落在主线程所在的节点上
+        loop->slab = NULL;
+        if (!config.numalocal)
+        {
+            loop->slab = allocslab(0, false);
+            if (loop->slab == NULL)
+            {
+                perror("mmap()");
+                return -1;
+            }
+            initfreelist(loop);
+        }
+    }
+
+    // 组内所有 socket 都 listen 之后再挂程序，程序返回的下标才和事件循环一一对应
+    if (config.steer && attachsteering(loops) != 0)
+        return -1;
+
+    printf("port=%d loops=%d numalocal=%s steer=%s\n", config.port, config.nloops,
+           config.numalocal ? "on" : "off", config.steer ? "cbpf" : "hash");
+
+    for (int i = 0; i < config.nloops; i++)
+        pthread_create(&threads[i], NULL, runloop, &loops[i]);
+
+    while (1)
+    {
+        sleep(REPORTINTERVAL);
+        report(loops);
+    }
+
+    return 0;
+}
+
+// 初始化服务端的监听端口。
+int initserver(int port)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+    {
+        printf("socket() failed.\n");
+        return -1;
+    }
+
+    int opt = 1;
+    unsigned int len = sizeof(opt);
+
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, len);
+    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &opt, len);
+    // 所有 bind 同一端口的 socket 都必须设置 SO_REUSEPORT（并且属于同一个用户）
+    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &opt, len);
+
+    struct sockaddr_in servaddr;
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    servaddr.sin_port = htons(port);
+
+    if (bind(sock, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0)
+    {
+        printf("bind() failed.\n");
+        close(sock);
+        return -1;
+    }
+
+    if (listen(sock, SOMAXCONN) != 0)
+    {
+        printf("listen() failed.\n");
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
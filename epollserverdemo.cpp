@@ -3,6 +3,20 @@
  * 1. 内核中保存一份文件描述符集合，无需用户每次都重新传入，只需告诉内核修改的部分
  * 2. 不再通过轮询的的方式找到就绪的 fd，而是通过异步 IO 事件唤醒 epoll_wait
  * 3. 内核仅会将有事件发生的 fd 返回给用户，用户无需遍历整个 fd 集合
+ *
+ * 事件循环的每一轮被切分成 wait、accept、read、handler、write 几个阶段分别计时，Ctrl-C 退出时输出每个阶段的
+ * 总耗时占比和耗时分布。wait 占比高说明还很闲；read/write/accept 占比高说明时间都花在系统调用上（kernel-bound），
+ * 加核之前应该先想办法减少系统调用；handler 占比高才是业务逻辑本身慢（handler-bound）。
+ * 计时用 rdtsc，一次只要几十个周期，可以一直开着。
+ *
+ * 同时按类型统计事件循环里的系统调用次数，退出时一起输出几个比值：
+ *     read/event    每个可读事件调用几次 read
+ *     eagain        read 返回 EAGAIN 的比例，这部分系统调用什么也没读到
+ *     bytes/read    每次 read 平均读到多少字节，缓冲区太小时会很低
+ *     epoll_wait 的批大小分布，经常返回 MAXEVENTS 个说明 MAXEVENTS 偏小
+ * 和 epollETserverdemo.cpp 的同名统计对比，可以看出 LT/ET 和读缓冲区大小的代价。
+ *
+ * 用 -DALLOC_HOOKS 编译时统计每一轮事件循环的堆分配次数，预热之后收发路径上不应该有任何分配，见 allochooks.h 和 bench.sh。
  * */
 
 #include <stdio.h>
@@ -10,27 +24,159 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
+#include <time.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/fcntl.h>
 #include <sys/types.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "allochooks.h"
 
 #define MAXEVENTS 1024
+// epoll_wait 批大小按 1,2,4,...,MAXEVENTS 分桶
+#define BATCHBUCKETS 11
 
-int initserver(int port);
+enum phase
+{
+    PH_WAIT,        // 阻塞在 epoll_wait 中
+    PH_ACCEPT,      // accept 新连接并注册到 epoll
+    PH_READ,        // read 客户端数据
+    PH_HANDLER,     // 处理请求，这里只是打印日志
+    PH_WRITE,       // write 回复
+    NPHASES
+};
+
+// 每个阶段的总耗时、次数和按 2 的幂分桶的耗时分布，单位都是 tick
+struct phasestats
+{
+    unsigned long long ticks;
+    unsigned long long count;
+    unsigned long long hist[64];
+};
+
+static struct phasestats phases[NPHASES];
+static double ticksperns = 1.0;
+static volatile sig_atomic_t stop = 0;
+
+// x86 上读 TSC，其他平台退回 clock_gettime，此时一个 tick 就是一纳秒
+static inline unsigned long long ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static inline void account(enum phase ph, unsigned long long start, unsigned long long end)
+{
+    unsigned long long d = end - start;
+    phases[ph].ticks += d;
+    phases[ph].count++;
+    phases[ph].hist[d == 0 ? 0 : 63 - __builtin_clzll(d)]++;
+}
+
+static void onsigint(int)
+{
+    stop = 1;
+}
+
+enum syscallid
+{
+    SC_EPOLL_WAIT,
+    SC_EPOLL_CTL,
+    SC_ACCEPT,
+    SC_READ,
+    SC_WRITE,
+    SC_SETSOCKOPT,
+    SC_CLOSE,
+    NSYSCALLS
+};
+
+struct syscallstats
+{
+    unsigned long long calls[NSYSCALLS];
+    unsigned long long eagain;          // read 返回 EAGAIN 的次数
+    unsigned long long readbytes;
+    unsigned long long readevents;      // 客户端 socket 上的可读事件数
+    unsigned long long events;          // epoll_wait 返回的事件总数
+    unsigned long long batches[BATCHBUCKETS];
+    unsigned long long fullbatches;     // 正好返回 MAXEVENTS 个事件的次数
+};
+
+static struct syscallstats syscalls;
+
+static void countbatch(int readyfds)
+{
+    if (readyfds <= 0)
+        return;
+    syscalls.events += readyfds;
+    int b = 0;
+    while (b < BATCHBUCKETS - 1 && (1 << b) < readyfds)
+        b++;
+    syscalls.batches[b]++;
+    if (readyfds == MAXEVENTS)
+        syscalls.fullbatches++;
+}
+
+void calibrate();
+void phasereport();
+void syscallreport();
+
+/**
+ * socket 调优参数，-1 表示不设置，沿用系统默认值
+ *
+ * nodelay       TCP_NODELAY，关闭 Nagle 算法，小包立即发出而不是等待攒够一个 MSS 或上一个包的 ACK
+ * rcvbuf/sndbuf SO_RCVBUF/SO_SNDBUF，收发缓冲区大小。设置在监听 socket 上，连接建立时才能协商出足够大的窗口
+ * notsentlowat  TCP_NOTSENT_LOWAT，发送缓冲区中"还没发出去"的数据低于这个值才报告可写，
+ *               避免一次塞进大量数据排在后面的小消息要等很久
+ * quickack      TCP_QUICKACK，立即回 ACK 而不是延迟确认。这个选项不是永久的，每次读之后都要重新设置
+ * fastopen      TCP_FASTOPEN，监听 socket 上 TFO 队列的长度，允许客户端在 SYN 里就带上数据，省掉一个 RTT
+ * */
+struct sockprofile
+{
+    int nodelay;
+    int rcvbuf;
+    int sndbuf;
+    int notsentlowat;
+    int quickack;
+    int fastopen;
+};
+
+int parseprofile(const char *spec, struct sockprofile *profile);
+int initserver(const char *addr, const struct sockprofile *profile);
+int tunesocket(int sock, const struct sockprofile *profile);
 
 int main(int argc, char *argv[])
 {
-    if (argc != 2)
+    if (argc != 2 && argc != 3)
     {
-        printf("usage: ./epollserverdemo port\n");
+        printf("usage: ./epollserverdemo port|unix:path|seqpacket:path [default|latency|throughput|option,option=value,...]\n");
+        printf("options: nodelay rcvbuf=N sndbuf=N notsentlowat=N quickack fastopen=N\n");
         return -1;
     }
 
+    struct sockprofile profile;
+    if (parseprofile(argc == 3 ? argv[2] : "default", &profile) != 0)
+    {
+        printf("bad socket profile: %s\n", argv[2]);
+        return -1;
+    }
+
+    // TCP 专有的参数在 Unix domain socket 上没有意义
+    bool tcp = strchr(argv[1], ':') == NULL;
+
     // 用于监听的 socket
-    int listensock = initserver(atoi(argv[1]));
+    int listensock = initserver(argv[1], &profile);
     if (listensock < 0)
     {
         printf("initserver() failed.\n");
@@ -38,6 +184,21 @@ int main(int argc, char *argv[])
     }
     printf("listensock=%d\n", listensock);
 
+    calibrate();
+    allocinit();
+
+    // 不设置 SA_RESTART，Ctrl-C 时 epoll_wait 返回 EINTR，退出循环输出各阶段的耗时
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onsigint;
+    sigaction(SIGINT, &sa, NULL);
+
+    // SIGINT 平时被屏蔽，只在 epoll_pwait 里原子地放开，处理事件期间到达的 Ctrl-C 也不会被错过
+    sigset_t blocked, waitmask;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    sigprocmask(SIG_BLOCK, &blocked, &waitmask);
+
     // 创建一个新的 epoll 实例，返回对应的 fd，参数无用，大于0即可
     int epollfd = epoll_create(1);
 
@@ -84,12 +245,21 @@ int main(int argc, char *argv[])
          * 
          * 返回值：返回有事件发生的 fd 数量，0 表示 timeout 期间都没有事件发生，-1 error
          * */
-        int readyfds = epoll_wait(epollfd, events, MAXEVENTS, -1);
+        unsigned long long t0 = ticks();
+        int readyfds = epoll_pwait(epollfd, events, MAXEVENTS, -1, &waitmask);
+        unsigned long long t1 = ticks();
+        account(PH_WAIT, t0, t1);
+        syscalls.calls[SC_EPOLL_WAIT]++;
+        countbatch(readyfds);
         if (readyfds == -1)
         {
-            perror("epoll() failed");
+            if (errno == EINTR && !stop)
+                continue;
+            if (!stop)
+                perror("epoll() failed");
             break;
         }
+        allocbegin();
 
         // 检查有事情发生的socket，包括监听和客户端连接的socket。
         for (int i = 0; i < readyfds; i++)
@@ -99,12 +269,15 @@ int main(int argc, char *argv[])
                 // error case
                 printf("epoll error\n");
                 close(events[i].data.fd);
+                syscalls.calls[SC_CLOSE]++;
+                allocchurn();
                 continue;
             }
             // 新的客户端连接
             if (events[i].data.fd == listensock)
             {
-                struct sockaddr_in client;
+                unsigned long long start = ticks();
+                struct sockaddr_storage client;
                 socklen_t len = sizeof(client);
 
                 /**
@@ -118,19 +291,27 @@ int main(int argc, char *argv[])
 
                 // 从 pending 的连接队列中取出第一个给 listensock，创建一个新的已连接的 socket，并返回 fd
                 int clientsock = accept(listensock, (struct sockaddr *)&client, &len);
+                syscalls.calls[SC_ACCEPT]++;
+                allocchurn();
 
                 if (clientsock < 0)
                 {
                     printf("accept() failed.\n");
+                    account(PH_ACCEPT, start, ticks());
                     continue;
                 }
 
                 printf("client(socket=%d) connected ok.\n", clientsock);
 
+                if (tcp)
+                    syscalls.calls[SC_SETSOCKOPT] += tunesocket(clientsock, &profile);
+
                 memset(&ev, 0, sizeof(struct epoll_event));
                 ev.data.fd = clientsock;
                 ev.events = EPOLLIN;
                 epoll_ctl(epollfd, EPOLL_CTL_ADD, clientsock, &ev);
+                syscalls.calls[SC_EPOLL_CTL]++;
+                account(PH_ACCEPT, start, ticks());
 
                 continue;    
             }
@@ -141,7 +322,16 @@ int main(int argc, char *argv[])
                 memset(buffer, 0, sizeof(buffer));
 
                 // 读取客户端的数据。
+                unsigned long long start = ticks();
                 ssize_t isize = read(events[i].data.fd, buffer, sizeof(buffer));
+                unsigned long long readend = ticks();
+                account(PH_READ, start, readend);
+                syscalls.calls[SC_READ]++;
+                syscalls.readevents++;
+                if (isize < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    syscalls.eagain++;
+                else if (isize > 0)
+                    syscalls.readbytes += isize;
                 // 发生了错误或socket被对方关闭。
                 if (isize <= 0)
                 {
@@ -153,25 +343,255 @@ int main(int argc, char *argv[])
                     // 从 epollfd 实例中移除对该 fd 的事件监视
                     epoll_ctl(epollfd, EPOLL_CTL_DEL, events[i].data.fd, &ev);
                     close(events[i].data.fd);
+                    syscalls.calls[SC_EPOLL_CTL]++;
+                    syscalls.calls[SC_CLOSE]++;
+                    allocchurn();
                     continue;
                 }
 
-                printf("recv(eventfd=%d,size=%ld):%s\n", events[i].data.fd, isize, buffer);
-                // 把收到的报文发回给客户端。
-                write(events[i].data.fd, buffer, strlen(buffer));
+                printf("recv(eventfd=%d,size=%ld):%.*s\n", events[i].data.fd, isize, (int)isize, buffer);
+                unsigned long long handlerend = ticks();
+                account(PH_HANDLER, readend, handlerend);
+
+                // 把收到的报文发回给客户端。读满 1024 字节时 buffer 没有 '\0' 结尾，要按实际长度写
+                write(events[i].data.fd, buffer, isize);
+                syscalls.calls[SC_WRITE]++;
+
+                // TCP_QUICKACK 会被内核自动清除，每次读完都重新打开
+                if (tcp && profile.quickack > 0)
+                {
+                    setsockopt(events[i].data.fd, IPPROTO_TCP, TCP_QUICKACK, &profile.quickack, sizeof(int));
+                    syscalls.calls[SC_SETSOCKOPT]++;
+                }
+                account(PH_WRITE, handlerend, ticks());
             }
         }
+        allocend();
     }
 
     // 别忘了最后关闭 epollfd
     close(epollfd); 
 
+    phasereport();
+    syscallreport();
+
+    return allocreport();
+}
+
+// 用 CLOCK_MONOTONIC 量一下 TSC 的频率，报告时把 tick 换算成纳秒
+void calibrate()
+{
+    struct timespec a, b;
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    unsigned long long start = ticks();
+    usleep(50000);
+    clock_gettime(CLOCK_MONOTONIC, &b);
+    unsigned long long end = ticks();
+
+    double ns = (b.tv_sec - a.tv_sec) * 1e9 + (b.tv_nsec - a.tv_nsec);
+    ticksperns = (end - start) / ns;
+}
+
+// 分桶的上界，2 的幂分桶只能精确到 2 倍
+static double phasepercentile(const struct phasestats *ps, double p)
+{
+    unsigned long long rank = (unsigned long long)(p * ps->count);
+    unsigned long long seen = 0;
+    for (int b = 0; b < 64; b++)
+    {
+        seen += ps->hist[b];
+        if (seen > rank)
+            return ((2ULL << b) - 1) / ticksperns;
+    }
+    return 0;
+}
+
+void phasereport()
+{
+    static const char *names[NPHASES] = {"wait", "accept", "read", "handler", "write"};
+
+    unsigned long long total = 0;
+    for (int ph = 0; ph < NPHASES; ph++)
+        total += phases[ph].ticks;
+    if (total == 0)
+        return;
+
+    printf("\nphase      share        count     avg(ns)   p50(ns)<=   p99(ns)<=\n");
+    for (int ph = 0; ph < NPHASES; ph++)
+    {
+        const struct phasestats *ps = &phases[ph];
+        printf("%-8s  %5.1f%%  %11llu  %10.0f  %10.0f  %10.0f\n", names[ph], 100.0 * ps->ticks / total, ps->count,
+               ps->count > 0 ? ps->ticks / ticksperns / ps->count : 0.0,
+               phasepercentile(ps, 0.5), phasepercentile(ps, 0.99));
+    }
+
+    // 不算等待的时间里，系统调用和业务逻辑各占多少
+    unsigned long long busy = total - phases[PH_WAIT].ticks;
+    if (busy > 0)
+        printf("busy %.1f%%: syscalls (accept+read+write) %.1f%%, handler %.1f%%\n", 100.0 * busy / total,
+               100.0 * (phases[PH_ACCEPT].ticks + phases[PH_READ].ticks + phases[PH_WRITE].ticks) / busy,
+               100.0 * phases[PH_HANDLER].ticks / busy);
+}
+
+void syscallreport()
+{
+    static const char *names[NSYSCALLS] = {"epoll_wait", "epoll_ctl", "accept", "read", "write", "setsockopt", "close"};
+
+    unsigned long long total = 0;
+    printf("\nsyscalls:");
+    for (int sc = 0; sc < NSYSCALLS; sc++)
+    {
+        printf(" %s=%llu", names[sc], syscalls.calls[sc]);
+        total += syscalls.calls[sc];
+    }
+    printf(" total=%llu\n", total);
+
+    unsigned long long reads = syscalls.calls[SC_READ];
+    unsigned long long waits = syscalls.calls[SC_EPOLL_WAIT];
+    printf("read/event=%.2f eagain=%.1f%% bytes/read=%.1f syscalls/KB=%.2f\n",
+           syscalls.readevents > 0 ? (double)reads / syscalls.readevents : 0.0,
+           reads > 0 ? 100.0 * syscalls.eagain / reads : 0.0,
+           reads > syscalls.eagain ? (double)syscalls.readbytes / (reads - syscalls.eagain) : 0.0,
+           syscalls.readbytes > 0 ? total * 1024.0 / syscalls.readbytes : 0.0);
+
+    unsigned long long batched = 0;
+    for (int b = 0; b < BATCHBUCKETS; b++)
+        batched += syscalls.batches[b];
+
+    printf("epoll_wait batch avg=%.2f (MAXEVENTS=%d, full=%llu, empty=%llu):",
+           batched > 0 ? (double)syscalls.events / batched : 0.0, MAXEVENTS, syscalls.fullbatches, waits - batched);
+    for (int b = 0; b < BATCHBUCKETS; b++)
+        if (syscalls.batches[b] > 0)
+            printf(" <=%d:%.1f%%", 1 << b, 100.0 * syscalls.batches[b] / batched);
+    printf("\n");
+}
+
+/**
+ * 解析 socket 调优参数。spec 可以是预设的名字，也可以是逗号分隔的选项列表：
+ *     default      只有 SO_REUSEADDR 和 SO_KEEPALIVE
+ *     latency      nodelay,quickack,notsentlowat=16384,fastopen=256
+ *     throughput   rcvbuf=4194304,sndbuf=4194304,fastopen=256
+ *     nodelay,sndbuf=262144
+ * */
+int parseprofile(const char *spec, struct sockprofile *profile)
+{
+    profile->nodelay = -1;
+    profile->rcvbuf = -1;
+    profile->sndbuf = -1;
+    profile->notsentlowat = -1;
+    profile->quickack = -1;
+    profile->fastopen = -1;
+
+    if (strcmp(spec, "default") == 0)
+        return 0;
+    if (strcmp(spec, "latency") == 0)
+        spec = "nodelay,quickack,notsentlowat=16384,fastopen=256";
+    else if (strcmp(spec, "throughput") == 0)
+        spec = "rcvbuf=4194304,sndbuf=4194304,fastopen=256";
+
+    char buf[256];
+    strncpy(buf, spec, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+
+    char *saveptr;
+    for (char *opt = strtok_r(buf, ",", &saveptr); opt != NULL; opt = strtok_r(NULL, ",", &saveptr))
+    {
+        char *eq = strchr(opt, '=');
+        int value = 1;
+        if (eq != NULL)
+        {
+            *eq = '\0';
+            value = atoi(eq + 1);
+        }
+
+        if (strcmp(opt, "nodelay") == 0)
+            profile->nodelay = value;
+        else if (strcmp(opt, "rcvbuf") == 0)
+            profile->rcvbuf = value;
+        else if (strcmp(opt, "sndbuf") == 0)
+            profile->sndbuf = value;
+        else if (strcmp(opt, "notsentlowat") == 0)
+            profile->notsentlowat = value;
+        else if (strcmp(opt, "quickack") == 0)
+            profile->quickack = value;
+        else if (strcmp(opt, "fastopen") == 0)
+            profile->fastopen = value;
+        else
+            return -1;
+    }
+
     return 0;
 }
 
+// 返回实际调用 setsockopt 的次数
+static int setopt(int sock, int level, int name, int value, const char *what)
+{
+    if (value < 0)
+        return 0;
+    if (setsockopt(sock, level, name, &value, sizeof(value)) != 0)
+        perror(what);
+    return 1;
+}
+
+// 设置在每个 accept 出来的连接上的参数，返回调用 setsockopt 的次数
+int tunesocket(int sock, const struct sockprofile *profile)
+{
+    return setopt(sock, IPPROTO_TCP, TCP_NODELAY, profile->nodelay, "setsockopt(TCP_NODELAY)") +
+           setopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, profile->notsentlowat, "setsockopt(TCP_NOTSENT_LOWAT)") +
+           setopt(sock, IPPROTO_TCP, TCP_QUICKACK, profile->quickack, "setsockopt(TCP_QUICKACK)");
+}
+
+/**
+ * 同一台机器上的客户端可以走 Unix domain socket：数据直接在两个 socket 的缓冲区之间拷贝，
+ * 不经过 TCP/IP 协议栈（没有校验和、拥塞控制、ACK、loopback 网卡），事件循环和协议完全不用改。
+ *     unix:path       SOCK_STREAM，和 TCP 一样是字节流
+ *     seqpacket:path  SOCK_SEQPACKET，面向连接且保留消息边界，一次 read 正好读到对端一次 write 的内容
+ * */
+static int initunixserver(const char *path, int type, const struct sockprofile *profile)
+{
+    int sock = socket(AF_UNIX, type, 0);
+    if (sock < 0)
+    {
+        printf("socket() failed.\n");
+        return -1;
+    }
+
+    setopt(sock, SOL_SOCKET, SO_RCVBUF, profile->rcvbuf, "setsockopt(SO_RCVBUF)");
+    setopt(sock, SOL_SOCKET, SO_SNDBUF, profile->sndbuf, "setsockopt(SO_SNDBUF)");
+
+    struct sockaddr_un servaddr;
+    memset(&servaddr, 0, sizeof(servaddr));
+    servaddr.sun_family = AF_UNIX;
+    strncpy(servaddr.sun_path, path, sizeof(servaddr.sun_path) - 1);
+
+    // socket 文件在进程退出后依然存在，相当于 TCP 的 SO_REUSEADDR，启动时先删掉
+    unlink(path);
+    if (bind(sock, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0)
+    {
+        printf("bind() failed.\n");
+        close(sock);
+        return -1;
+    }
+
+    if (listen(sock, SOMAXCONN) != 0)
+    {
+        printf("listen() failed.\n");
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
 // 初始化服务端的监听端口。
-int initserver(int port)
+int initserver(const char *addr, const struct sockprofile *profile)
 {
+    if (strncmp(addr, "unix:", 5) == 0)
+        return initunixserver(addr + 5, SOCK_STREAM, profile);
+    if (strncmp(addr, "seqpacket:", 10) == 0)
+        return initunixserver(addr + 10, SOCK_SEQPACKET, profile);
+
+    int port = atoi(addr);
     int sock = socket(AF_INET, SOCK_STREAM, 0);
     if (sock < 0)
     {
@@ -185,6 +605,11 @@ int initserver(int port)
     setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, len);
     setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &opt, len);
 
+    // 缓冲区大小要在 listen 之前设置，窗口扩大因子在三次握手时就确定了，accept 出来的连接会继承
+    setopt(sock, SOL_SOCKET, SO_RCVBUF, profile->rcvbuf, "setsockopt(SO_RCVBUF)");
+    setopt(sock, SOL_SOCKET, SO_SNDBUF, profile->sndbuf, "setsockopt(SO_SNDBUF)");
+    setopt(sock, IPPROTO_TCP, TCP_FASTOPEN, profile->fastopen, "setsockopt(TCP_FASTOPEN)");
+
     struct sockaddr_in servaddr;
     servaddr.sin_family = AF_INET;
     // INADDR_ANY is used when you don't need to bind a socket to a specific IP.
@@ -203,7 +628,8 @@ int initserver(int port)
 
     //  listen() marks the socket referred to by sockfd as a passive socket, that is,
     // as a socket that will be used to accept incoming connection requests using accept(2).
-    if (listen(sock, 5) != 0)
+    // 压测时会同时发起大量连接，accept 队列太短会丢弃 SYN，客户端要等 1 秒重传
+    if (listen(sock, SOMAXCONN) != 0)
     {
         printf("listen() failed.\n");
         close(sock);
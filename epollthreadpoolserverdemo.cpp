@@ -0,0 +1,568 @@
+/**
+ * epoll + 工作窃取线程池
+ *
+ * 压缩、哈希之类的 CPU 密集型 handler 如果直接在 epoll 线程里跑，这段时间所有其他连接都得不到服务。
+ * 这里把计算丢给线程池，epoll 线程只负责收发：
+ *
+ * 1. epoll 线程读到请求后 submit() 一个 job，轮流放进各个 worker 自己的双端队列
+ * 2. worker 优先从自己队列的头部取任务，自己没活干时从别的 worker 队列的尾部"偷"任务，
+ *    这样某个 worker 被一个慢任务卡住时，排在它后面的任务会被空闲的 worker 拿走
+ * 3. worker 算完后把 job 推进一个无锁的多生产者单消费者（MPSC）完成队列，
+ *    再通过 eventfd 唤醒 epoll 线程；epoll 线程把 eventfd 当作普通 fd 一起监听
+ * 4. 同一批完成的 job 只写一次 eventfd，epoll 线程读走计数后一次性取空队列
+ *
+ * 每个连接同一时刻最多有一个 job 在计算，期间暂停监听它的 EPOLLIN，保证回复顺序和请求一致。
+ * 回复一次没写完时剩下的部分留在连接的输出缓冲区里，改为等 EPOLLOUT，写完才恢复读。
+ *
+ * Ctrl-C 退出时通知 worker 停止并 join 所有线程，丢弃还没算完的任务。
+ *
+ * 编译：g++ -std=c++17 -O2 -pthread -o epollthreadpoolserverdemo epollthreadpoolserverdemo.cpp
+ * */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/fcntl.h>
+#include <sys/types.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define MAXEVENTS 1024
+#define MAXFDS 65536
+
+int initserver(int port);
+
+// 一次计算任务，同时也是 MPSC 完成队列的节点
+struct job
+{
+    int fd;
+    unsigned int gen;           // 提交时连接的代数，用于识别 fd 已被关闭并复用的情况
+    int rounds;
+    std::string data;
+    std::string result;
+    std::atomic<job *> next;
+};
+
+/**
+ * 无锁 MPSC 队列（Vyukov 算法）
+ *
+ * 生产者只做一次 exchange 和一次 store，消费者单线程，不需要 CAS 循环。
+ * signalled 标记保证一批连续的 push 只触发一次 eventfd 写入。
+ * */
+struct mpscqueue
+{
+    job stub;
+    std::atomic<job *> head;   // 生产者端
+    job *tail;                 // 消费者端
+    std::atomic<bool> signalled;
+    int efd;
+
+    void init()
+    {
+        stub.next.store(NULL, std::memory_order_relaxed);
+        head.store(&stub, std::memory_order_relaxed);
+        tail = &stub;
+        signalled.store(false, std::memory_order_relaxed);
+        efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+
+    void push(job *j)
+    {
+        j->next.store(NULL, std::memory_order_relaxed);
+        job *prev = head.exchange(j, std::memory_order_acq_rel);
+        prev->next.store(j, std::memory_order_release);
+
+        if (!signalled.exchange(true, std::memory_order_acq_rel))
+        {
+            uint64_t one = 1;
+            if (write(efd, &one, sizeof(one)) < 0)
+                perror("write(eventfd)");
+        }
+    }
+
+    // 只能由 epoll 线程调用。返回 NULL 表示暂时为空（或生产者正处在两步 push 之间）
+    job *pop()
+    {
+        job *t = tail;
+        job *next = t->next.load(std::memory_order_acquire);
+
+        if (t == &stub)
+        {
+            if (next == NULL)
+                return NULL;
+            tail = next;
+            t = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+
+        if (next != NULL)
+        {
+            tail = next;
+            return t;
+        }
+
+        if (t != head.load(std::memory_order_acquire))
+            return NULL;
+
+        // t 是最后一个节点，放回 stub 之后才能把它取走
+        push_stub();
+        next = t->next.load(std::memory_order_acquire);
+        if (next != NULL)
+        {
+            tail = next;
+            return t;
+        }
+        return NULL;
+    }
+
+    void push_stub()
+    {
+        stub.next.store(NULL, std::memory_order_relaxed);
+        job *prev = head.exchange(&stub, std::memory_order_acq_rel);
+        prev->next.store(&stub, std::memory_order_release);
+    }
+};
+
+/**
+ * 工作窃取线程池
+ *
+ * 每个 worker 一个带锁的双端队列：自己从头部取，别人从尾部偷，两端的竞争很少。
+ * 所有队列都空时 worker 在条件变量上睡眠，pending 记录尚未被取走的任务数。
+ * */
+struct workerqueue
+{
+    std::mutex lock;
+    std::deque<job *> jobs;
+};
+
+struct threadpool
+{
+    std::vector<workerqueue> queues;
+    std::vector<std::thread> threads;
+    std::mutex sleeplock;
+    std::condition_variable wakeup;
+    std::atomic<int> pending;
+    std::atomic<bool> stopping;
+    unsigned int next;
+    mpscqueue *done;
+
+    explicit threadpool(int nthreads, mpscqueue *q) : queues(nthreads), pending(0), stopping(false), next(0), done(q)
+    {
+        for (int i = 0; i < nthreads; i++)
+            threads.emplace_back(&threadpool::run, this, i);
+    }
+
+    ~threadpool()
+    {
+        shutdown();
+    }
+
+    // 叫醒所有 worker 让它们退出并 join，队列里还没被取走的任务直接丢弃。可以重复调用
+    void shutdown()
+    {
+        {
+            std::lock_guard<std::mutex> guard(sleeplock);
+            stopping.store(true, std::memory_order_release);
+        }
+        wakeup.notify_all();
+
+        for (std::thread &t : threads)
+            t.join();
+        threads.clear();
+
+        for (workerqueue &q : queues)
+        {
+            for (job *j : q.jobs)
+                delete j;
+            q.jobs.clear();
+        }
+    }
+
+    // 由 epoll 线程调用，轮流分配到各个 worker 的队列
+    void submit(job *j)
+    {
+        workerqueue &q = queues[next++ % queues.size()];
+        {
+            std::lock_guard<std::mutex> guard(q.lock);
+            q.jobs.push_back(j);
+        }
+
+        pending.fetch_add(1, std::memory_order_release);
+        std::lock_guard<std::mutex> guard(sleeplock);
+        wakeup.notify_one();
+    }
+
+    job *take(int self)
+    {
+        // 先看自己的队列头部
+        {
+            workerqueue &q = queues[self];
+            std::lock_guard<std::mutex> guard(q.lock);
+            if (!q.jobs.empty())
+            {
+                job *j = q.jobs.front();
+                q.jobs.pop_front();
+                return j;
+            }
+        }
+
+        // 再从其他 worker 的队列尾部偷
+        for (size_t k = 1; k < queues.size(); k++)
+        {
+            workerqueue &q = queues[(self + k) % queues.size()];
+            std::lock_guard<std::mutex> guard(q.lock);
+            if (!q.jobs.empty())
+            {
+                job *j = q.jobs.back();
+                q.jobs.pop_back();
+                return j;
+            }
+        }
+
+        return NULL;
+    }
+
+    void run(int self)
+    {
+        while (!stopping.load(std::memory_order_acquire))
+        {
+            job *j = take(self);
+            if (j == NULL)
+            {
+                std::unique_lock<std::mutex> guard(sleeplock);
+                wakeup.wait(guard, [this] {
+                    return pending.load(std::memory_order_acquire) > 0 || stopping.load(std::memory_order_acquire);
+                });
+                continue;
+            }
+
+            pending.fetch_sub(1, std::memory_order_acq_rel);
+            compute(j);
+            done->push(j);
+        }
+    }
+
+    // CPU 密集型 handler 的示例：对报文反复做 64 位 FNV-1a 哈希
+    static void compute(job *j)
+    {
+        uint64_t h = 14695981039346656037ULL;
+        for (int r = 0; r < j->rounds; r++)
+        {
+            for (size_t i = 0; i < j->data.size(); i++)
+            {
+                h ^= (unsigned char)j->data[i];
+                h *= 1099511628211ULL;
+            }
+        }
+
+        char line[32];
+        int n = snprintf(line, sizeof(line), "%016llx\n", (unsigned long long)h);
+        j->result.assign(line, n);
+    }
+};
+
+// 每个连接的状态
+struct conn
+{
+    unsigned int gen;
+    bool busy;          // 是否有 job 正在线程池里计算，或者它的回复还没写完
+    std::string out;    // 还没写出去的回复
+    size_t outpos;
+};
+
+static int epollfd;
+static conn conns[MAXFDS];
+static volatile sig_atomic_t stop = 0;
+
+static void onsigint(int)
+{
+    stop = 1;
+}
+
+static void set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags == -1) {
+    perror("fcntl()");
+    return;
+  }
+  if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    perror("fcntl()");
+  }
+}
+
+static void watch(int fd, int op, uint32_t events)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(struct epoll_event));
+    ev.data.fd = fd;
+    ev.events = events;
+    epoll_ctl(epollfd, op, fd, &ev);
+}
+
+static void closeconn(int fd)
+{
+    printf("client(eventfd=%d) disconnected.\n", fd);
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL);
+    conns[fd].gen++;
+    conns[fd].busy = false;
+    conns[fd].out.clear();
+    conns[fd].outpos = 0;
+    close(fd);
+}
+
+/**
+ * 尽量把输出缓冲区写出去。
+ * 返回 1 全部写完；0 socket 缓冲区满了还有剩余；-1 出错
+ * */
+static int flush(int fd, conn *c)
+{
+    while (c->outpos < c->out.size())
+    {
+        ssize_t n = write(fd, c->out.data() + c->outpos, c->out.size() - c->outpos);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        c->outpos += n;
+    }
+
+    c->out.clear();
+    c->outpos = 0;
+    return 1;
+}
+
+// 回复写完了：这个连接可以接着读下一个请求
+static void replied(int fd, int r)
+{
+    if (r < 0)
+    {
+        closeconn(fd);
+        return;
+    }
+    if (r == 0)
+    {
+        // 还有剩余，等 EPOLLOUT 接着写，这期间仍然不读新请求
+        watch(fd, EPOLL_CTL_MOD, EPOLLOUT);
+        return;
+    }
+    conns[fd].busy = false;
+    watch(fd, EPOLL_CTL_MOD, EPOLLIN);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 4)
+    {
+        printf("usage: ./epollthreadpoolserverdemo port [threads] [rounds]\n");
+        return -1;
+    }
+
+    int nthreads = argc > 2 ? atoi(argv[2]) : (int)std::thread::hardware_concurrency();
+    int rounds = argc > 3 ? atoi(argv[3]) : 10000;
+    if (nthreads <= 0)
+        nthreads = 1;
+
+    // 用于监听的 socket
+    int listensock = initserver(atoi(argv[1]));
+    if (listensock < 0)
+    {
+        printf("initserver() failed.\n");
+        return -1;
+    }
+    printf("listensock=%d threads=%d rounds=%d\n", listensock, nthreads, rounds);
+
+    // 不设置 SA_RESTART，Ctrl-C 时 epoll_pwait 返回 EINTR，退出循环停掉线程池。
+    // SIGINT 平时被屏蔽，只在 epoll_pwait 里原子地放开，处理事件期间到达的 Ctrl-C 也不会被错过
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onsigint;
+    sigaction(SIGINT, &sa, NULL);
+
+    sigset_t blocked, waitmask;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    sigprocmask(SIG_BLOCK, &blocked, &waitmask);
+
+    epollfd = epoll_create(1);
+
+    mpscqueue done;
+    done.init();
+    threadpool pool(nthreads, &done);
+
+    watch(listensock, EPOLL_CTL_ADD, EPOLLIN);
+    // eventfd 和 socket 一样交给 epoll 监听
+    watch(done.efd, EPOLL_CTL_ADD, EPOLLIN);
+
+    while (1)
+    {
+        struct epoll_event events[MAXEVENTS];
+
+        int readyfds = epoll_pwait(epollfd, events, MAXEVENTS, -1, &waitmask);
+        if (readyfds == -1)
+        {
+            if (errno == EINTR && !stop)
+                continue;
+            if (!stop)
+                perror("epoll() failed");
+            break;
+        }
+
+        for (int i = 0; i < readyfds; i++)
+        {
+            int fd = events[i].data.fd;
+
+            // 线程池有结果送回
+            if (fd == done.efd)
+            {
+                uint64_t count;
+                if (read(done.efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                    perror("read(eventfd)");
+
+                // 先清标记再取队列，不会丢唤醒。清标记必须用 exchange：单纯的 store 之后跟着 pop 里的 load，
+                // 可能被重排（StoreLoad，x86 上也会发生），这里看到队列为空，而 push 的 exchange 还读到旧的 true，
+                // 没写 eventfd。用读-改-写之后，两边的 exchange 在 signalled 上有先后：
+                // push 的在前，这次 exchange 读到它写的 true，同步之后 pop 一定能看到那个结果；
+                // push 的在后，它读到 false，会再写一次 eventfd
+                done.signalled.exchange(false, std::memory_order_acq_rel);
+
+                job *j;
+                while ((j = done.pop()) != NULL)
+                {
+                    // 连接在计算期间已经断开（fd 甚至可能已被新连接复用），结果直接丢弃
+                    if (conns[j->fd].gen == j->gen && conns[j->fd].busy)
+                    {
+                        conn *c = &conns[j->fd];
+                        c->out.swap(j->result);
+                        c->outpos = 0;
+                        replied(j->fd, flush(j->fd, c));
+                    }
+                    delete j;
+                }
+                continue;
+            }
+
+            // 新的客户端连接
+            if (fd == listensock)
+            {
+                int clientsock = accept(listensock, NULL, NULL);
+                if (clientsock < 0)
+                {
+                    printf("accept() failed.\n");
+                    continue;
+                }
+                if (clientsock >= MAXFDS)
+                {
+                    close(clientsock);
+                    continue;
+                }
+
+                printf("client(socket=%d) connected ok.\n", clientsock);
+
+                set_nonblocking(clientsock);
+                conns[clientsock].busy = false;
+                watch(clientsock, EPOLL_CTL_ADD, EPOLLIN);
+                continue;
+            }
+
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
+            {
+                closeconn(fd);
+                continue;
+            }
+
+            // 上一个回复没写完，socket 可写了继续写
+            if (events[i].events & EPOLLOUT)
+            {
+                replied(fd, flush(fd, &conns[fd]));
+                continue;
+            }
+
+            char buffer[1024];
+            ssize_t isize = read(fd, buffer, sizeof(buffer));
+            if (isize <= 0)
+            {
+                if (isize < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    continue;
+                closeconn(fd);
+                continue;
+            }
+
+            job *j = new job;
+            j->fd = fd;
+            j->gen = conns[fd].gen;
+            j->rounds = rounds;
+            j->data.assign(buffer, isize);
+
+            // 结果回来之前不再读这个连接，后续请求留在内核缓冲区里
+            conns[fd].busy = true;
+            watch(fd, EPOLL_CTL_MOD, 0);
+
+            pool.submit(j);
+        }
+    }
+
+    // 先停线程池，worker 都退出之后完成队列里剩下的结果才能安全地取走释放
+    pool.shutdown();
+    job *j;
+    while ((j = done.pop()) != NULL)
+        delete j;
+
+    close(epollfd);
+
+    return 0;
+}
+
+// 初始化服务端的监听端口。
+int initserver(int port)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+    {
+        printf("socket() failed.\n");
+        return -1;
+    }
+
+    int opt = 1;
+    unsigned int len = sizeof(opt);
+
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, len);
+    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &opt, len);
+
+    struct sockaddr_in servaddr;
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    servaddr.sin_port = htons(port);
+
+    if (bind(sock, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0)
+    {
+        printf("bind() failed.\n");
+        close(sock);
+        return -1;
+    }
+
+    if (listen(sock, 5) != 0)
+    {
+        printf("listen() failed.\n");
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
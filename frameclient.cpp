@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+// 与 epollframeserverdemo.cpp 配套的客户端：每条消息前加 4 字节大端序长度
+
+// 读满 n 个字节，返回 0 表示成功
+static int readn(int fd, char *buf, size_t n)
+{
+    while (n > 0)
+    {
+        ssize_t r = read(fd, buf, n);
+        if (r <= 0)
+        {
+            if (r < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += r;
+        n -= r;
+    }
+    return 0;
+}
+
+static int writen(int fd, const char *buf, size_t n)
+{
+    while (n > 0)
+    {
+        ssize_t w = write(fd, buf, n);
+        if (w <= 0)
+        {
+            if (w < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += w;
+        n -= w;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        printf("usage:./frameclient ip port\n");
+        return -1;
+    }
+
+    int sockfd;
+    struct sockaddr_in servaddr;
+    char buf[1024];
+
+    if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    {
+        printf("socket() failed.\n");
+        return -1;
+    }
+
+    memset(&servaddr, 0, sizeof(servaddr));
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_port = htons(atoi(argv[2]));
+    servaddr.sin_addr.s_addr = inet_addr(argv[1]);
+
+    if (connect(sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) != 0)
+    {
+        printf("connect(%s:%s) failed.\n", argv[1], argv[2]);
+        close(sockfd);
+        return -1;
+    }
+
+    printf("connect ok.\n");
+
+    while (1)
+    {
+        printf("please input:");
+        if (fgets(buf, sizeof(buf), stdin) == NULL)
+            break;
+
+        // 去掉行尾换行，长度由帧头给出，payload 里可以有任意字节
+        uint32_t len = strcspn(buf, "\n");
+        uint32_t hdr = htonl(len);
+
+        if (writen(sockfd, (char *)&hdr, sizeof(hdr)) != 0 || writen(sockfd, buf, len) != 0)
+        {
+            printf("write() failed.\n");
+            close(sockfd);
+            return -1;
+        }
+
+        // 先读帧头拿到长度，再读 payload
+        if (readn(sockfd, (char *)&hdr, sizeof(hdr)) != 0)
+        {
+            printf("read() failed.\n");
+            close(sockfd);
+            return -1;
+        }
+
+        len = ntohl(hdr);
+        if (len >= sizeof(buf) || readn(sockfd, buf, len) != 0)
+        {
+            printf("read() failed.\n");
+            close(sockfd);
+            return -1;
+        }
+
+        printf("recv(size=%u):%.*s\n", len, (int)len, buf);
+    }
+
+    close(sockfd);
+    return 0;
+}
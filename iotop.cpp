@@ -0,0 +1,221 @@
+/**
+ * 类似 top 的事件循环查看器
+ *
+ * 只读地映射 epollmetricsserverdemo -s name 发布的共享内存统计段，每隔一段时间读一次每个事件循环的快照，
+ * 和上一次的快照相减得到速率。被观察的进程里没有任何额外的线程、端口或锁，读者再多也不影响它。
+ *
+ * 快照由 seqlock 保护：先读序号，奇数说明写者正在写，等一下再读；
+ * 读完数据再读一次序号，和第一次不同说明中途被改写过，整份重读。
+ *
+ * 每列的含义：
+ *     conns       当前连接数
+ *     acc/s       每秒新建连接
+ *     in/out MB/s 每秒读入、写出的字节
+ *     wake/s      每秒 epoll_wait 返回次数
+ *     ev/wake     每次 epoll_wait 平均返回的事件数
+ *     rd/wake     每次唤醒平均调用 read 的次数
+ *     eagain%     read/write 中返回 EAGAIN 的比例
+ *     reply/s     每秒完成的回复
+ *
+ * 编译：g++ -std=c++17 -O2 -o iotop iotop.cpp
+ * 示例：./iotop iodemo
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <atomic>
+
+// 与 epollmetricsserverdemo.cpp 中的定义一致
+#define STATSMAGIC 0x494f5354
+#define MAXLOOPS 64
+
+enum
+{
+    ST_TIME,
+    ST_ACCEPTS,
+    ST_CLOSES,
+    ST_BYTESIN,
+    ST_BYTESOUT,
+    ST_READS,
+    ST_WRITES,
+    ST_EAGAIN,
+    ST_WAKEUPS,
+    ST_EVENTS,
+    ST_REPLIES,
+    NSTATS
+};
+
+struct alignas(64) statsslot
+{
+    std::atomic<uint32_t> seq;
+    std::atomic<uint64_t> values[NSTATS];
+};
+
+struct statssegment
+{
+    uint32_t magic;
+    uint32_t nloops;
+    int32_t pid;
+    statsslot loops[MAXLOOPS];
+};
+
+/**
+ * 读出一个槽位的完整快照。写者每 100ms 才写一次，正常情况下一次就能读到
+ * */
+static void readslot(const statsslot *slot, uint64_t *values)
+{
+    for (;;)
+    {
+        uint32_t before = slot->seq.load(std::memory_order_acquire);
+        if (before & 1)
+        {
+            sched_yield();
+            continue;
+        }
+
+        for (int i = 0; i < NSTATS; i++)
+            values[i] = slot->values[i].load(std::memory_order_relaxed);
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot->seq.load(std::memory_order_relaxed) == before)
+            return;
+    }
+}
+
+static double ratio(uint64_t a, uint64_t b)
+{
+    return b > 0 ? (double)a / b : 0.0;
+}
+
+static void printrow(const char *name, const uint64_t *cur, const uint64_t *prev, double seconds)
+{
+    uint64_t d[NSTATS];
+    for (int i = 0; i < NSTATS; i++)
+        d[i] = cur[i] - prev[i];
+
+    printf("%-5s %7llu %8.0f %8.2f %8.2f %9.0f %8.2f %8.2f %7.1f%% %9.0f\n", name,
+           (unsigned long long)(cur[ST_ACCEPTS] - cur[ST_CLOSES]),
+           d[ST_ACCEPTS] / seconds,
+           d[ST_BYTESIN] / seconds / 1e6,
+           d[ST_BYTESOUT] / seconds / 1e6,
+           d[ST_WAKEUPS] / seconds,
+           ratio(d[ST_EVENTS], d[ST_WAKEUPS]),
+           ratio(d[ST_READS], d[ST_WAKEUPS]),
+           100.0 * ratio(d[ST_EAGAIN], d[ST_READS] + d[ST_WRITES]),
+           d[ST_REPLIES] / seconds);
+}
+
+int main(int argc, char *argv[])
+{
+    int interval = 1000;
+    int iterations = -1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "i:n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            interval = atoi(optarg);
+            break;
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        default:
+            interval = 0;
+            break;
+        }
+    }
+    if (optind != argc - 1 || interval <= 0)
+    {
+        printf("usage: ./iotop [-i interval_ms] [-n iterations] shmname\n");
+        return -1;
+    }
+
+    char path[256];
+    snprintf(path, sizeof(path), "/%s", argv[optind]);
+
+    int fd = shm_open(path, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        perror("shm_open()");
+        return -1;
+    }
+
+    // 只读映射，查看端不可能写坏被观察进程的数据
+    const statssegment *seg = (const statssegment *)mmap(NULL, sizeof(statssegment), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (seg == MAP_FAILED)
+    {
+        perror("mmap()");
+        return -1;
+    }
+    if (seg->magic != STATSMAGIC || seg->nloops == 0 || seg->nloops > MAXLOOPS)
+    {
+        printf("%s is not a stats segment.\n", path);
+        return -1;
+    }
+
+    int nloops = seg->nloops;
+    static uint64_t prev[MAXLOOPS][NSTATS], cur[MAXLOOPS][NSTATS];
+    for (int i = 0; i < nloops; i++)
+        readslot(&seg->loops[i], prev[i]);
+
+    bool tty = isatty(STDOUT_FILENO);
+
+    while (iterations != 0)
+    {
+        usleep(interval * 1000);
+
+        if (kill(seg->pid, 0) != 0)
+        {
+            printf("process %d exited.\n", seg->pid);
+            break;
+        }
+
+        uint64_t total[NSTATS] = {0}, totalprev[NSTATS] = {0};
+        for (int i = 0; i < nloops; i++)
+        {
+            readslot(&seg->loops[i], cur[i]);
+            for (int k = 0; k < NSTATS; k++)
+            {
+                total[k] += cur[i][k];
+                totalprev[k] += prev[i][k];
+            }
+        }
+
+        if (tty)
+            printf("\033[H\033[2J");
+        printf("pid %d, %d loops, every %d ms\n", seg->pid, nloops, interval);
+        printf("loop    conns    acc/s  in MB/s out MB/s    wake/s  ev/wake  rd/wake eagain%%   reply/s\n");
+
+        // 每个槽位用自己的快照时间算速率，不受本进程 usleep 误差的影响
+        double seconds = 0;
+        for (int i = 0; i < nloops; i++)
+        {
+            double s = (cur[i][ST_TIME] - prev[i][ST_TIME]) / 1e9;
+            char name[16];
+            snprintf(name, sizeof(name), "%d", i);
+            printrow(name, cur[i], prev[i], s > 0 ? s : interval / 1e3);
+            if (s > seconds)
+                seconds = s;
+        }
+
+        // ST_TIME 的总和没有意义，合计一行用最长的间隔
+        printrow("all", total, totalprev, seconds > 0 ? seconds : interval / 1e3);
+        fflush(stdout);
+
+        memcpy(prev, cur, sizeof(prev));
+        if (iterations > 0)
+            iterations--;
+    }
+
+    return 0;
+}
@@ -0,0 +1,693 @@
+/**
+ * 共享内存环形缓冲区传输：同一台机器上的 echo
+ *
+ * 即使是 Unix domain socket，每条消息也要经过两次系统调用和两次拷贝（用户态 -> 内核 -> 用户态），
+ * 还可能伴随一次进程唤醒。同一台机器上的两个进程可以直接共享一块内存：
+ *
+ * 1. 客户端连接服务端的 Unix socket（只用来建立"连接"和感知对端退出）
+ * 2. 服务端用 memfd_create 创建一块匿名共享内存，里面放两个单生产者单消费者（SPSC）的环形缓冲区：
+ *        c2s  客户端 -> 服务端
+ *        s2c  服务端 -> 客户端
+ *    再创建两个 eventfd 用于唤醒，通过 SCM_RIGHTS 把 memfd 和 eventfd 一起发给客户端，双方各自 mmap
+ * 3. 发消息就是往环里写数据再移动 head，收消息就是读数据再移动 tail，全程没有系统调用
+ *
+ * 唤醒只在对端睡着时才需要：
+ *     消费者：环空了先自旋一会儿（-p 微秒），还没有数据就置 sleeping=1，再检查一次环，确实为空才阻塞在 eventfd 上
+ *     生产者：写入后检查 sleeping，为 1 才写 eventfd
+ * 两边都用 seq_cst 的内存序，保证"消费者置位后再检查"和"生产者写入后再检查"不会同时错过对方，不会丢唤醒。
+ * 对端一直很忙（或者在自旋）时，消息传递完全不进内核，往返延迟可以到亚微秒级（需要双方在不同的 CPU 上）。
+ *
+ * 环中每条消息是 [4 字节长度][数据]，按 8 字节对齐；放不下到环尾时写一个 WRAP 标记跳回开头，
+ * 保证每条消息在内存里都是连续的。
+ *
+ * 编译：g++ -std=c++17 -O2 -o shmringdemo shmringdemo.cpp
+ * 用法：./shmringdemo server /tmp/shmring.sock [-p spin_us]
+ *      ./shmringdemo client /tmp/shmring.sock                          交互式，和 client.cpp 一样
+ *      ./shmringdemo bench /tmp/shmring.sock [-n msgs] [-s size] [-p spin_us]   一问一答测往返延迟
+ * */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/fcntl.h>
+#include <sys/types.h>
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#define MAXEVENTS 1024
+#define MAXCLIENTS 1024
+// 每个环的容量，必须是 2 的幂
+#define RINGSIZE (1 << 20)
+// 单条消息的上限
+#define MAXMSG (RINGSIZE / 4)
+// 放不下到环尾时的跳转标记
+#define WRAP 0xffffffffu
+
+static long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * SPSC 环。head 只由生产者写，tail 只由消费者写，各占一条 cache line 避免伪共享。
+ * head/tail 是单调递增的字节数，取模得到位置。
+ * */
+struct ring
+{
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+    alignas(64) std::atomic<uint32_t> sleeping;   // 消费者是否阻塞在 eventfd 上
+    alignas(64) char data[RINGSIZE];
+};
+
+// 共享内存的布局，双方必须一致
+struct segment
+{
+    ring c2s;
+    ring s2c;
+};
+
+static uint32_t align8(uint32_t n)
+{
+    return (n + 7) & ~7u;
+}
+
+/**
+ * 写入一条消息，环满时返回 false
+ * */
+static bool ring_push(ring *r, const char *msg, uint32_t len)
+{
+    uint64_t head = r->head.load(std::memory_order_relaxed);
+    uint64_t tail = r->tail.load(std::memory_order_acquire);
+    uint32_t need = align8(4 + len);
+    uint32_t pos = head & (RINGSIZE - 1);
+
+    // 到环尾放不下，这段空间作废，从头开始
+    uint32_t skip = pos + need > RINGSIZE ? RINGSIZE - pos : 0;
+    if (RINGSIZE - (head - tail) < skip + need)
+        return false;
+
+    if (skip > 0)
+    {
+        uint32_t wrap = WRAP;
+        memcpy(r->data + pos, &wrap, 4);
+        pos = 0;
+    }
+
+    memcpy(r->data + pos, &len, 4);
+    memcpy(r->data + pos + 4, msg, len);
+
+    // release：消费者看到新的 head 时一定也能看到上面写入的数据
+    r->head.store(head + skip + need, std::memory_order_release);
+    return true;
+}
+
+/**
+ * 查看下一条消息（不移动 tail），*msg 直接指向共享内存。
+ * 返回 1 有消息；0 环空；-1 协议错误
+ *
+ * 长度字和 head 都是对端写的，不能信任：长度超过 MAXMSG、记录越过环尾或者超出 head 时，
+ * 照着它拷贝会读出映射范围，tail 也会被推到任意位置，一律当作协议错误，由调用方断开对端
+ * */
+static int ring_peek(ring *r, const char **msg, uint32_t *len)
+{
+    uint64_t tail = r->tail.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        uint64_t head = r->head.load(std::memory_order_acquire);
+        if (tail == head)
+            return 0;
+
+        uint32_t pos = tail & (RINGSIZE - 1);
+        memcpy(len, r->data + pos, 4);
+        if (*len != WRAP)
+        {
+            if (*len > MAXMSG || align8(4 + *len) > RINGSIZE - pos || align8(4 + *len) > head - tail)
+                return -1;
+            *msg = r->data + pos + 4;
+            return 1;
+        }
+
+        // 跳过环尾作废的空间
+        if (RINGSIZE - pos > head - tail)
+            return -1;
+        tail += RINGSIZE - pos;
+        r->tail.store(tail, std::memory_order_release);
+    }
+}
+
+static void ring_pop(ring *r, uint32_t len)
+{
+    uint64_t tail = r->tail.load(std::memory_order_relaxed);
+    r->tail.store(tail + align8(4 + len), std::memory_order_release);
+}
+
+static bool ring_empty(ring *r)
+{
+    return r->tail.load(std::memory_order_seq_cst) == r->head.load(std::memory_order_seq_cst);
+}
+
+// 生产者写入之后调用：只有消费者睡着时才真正写 eventfd
+static void ring_notify(ring *r, int efd)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (r->sleeping.load(std::memory_order_seq_cst) && r->sleeping.exchange(0, std::memory_order_seq_cst))
+    {
+        uint64_t one = 1;
+        if (write(efd, &one, sizeof(one)) < 0)
+            perror("write(eventfd)");
+    }
+}
+
+/**
+ * 消费者准备阻塞前调用。返回 true 表示可以睡了；false 表示置位之后又来了数据，应该继续处理
+ * */
+static bool ring_prepare_sleep(ring *r)
+{
+    r->sleeping.store(1, std::memory_order_seq_cst);
+    if (!ring_empty(r))
+    {
+        r->sleeping.store(0, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+// 自旋等待时告诉 CPU 这是忙等：x86 上 pause，aarch64 上 yield，其他平台只是一个编译器屏障，防止循环被优化掉
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield" ::: "memory");
+#else
+    asm volatile("" ::: "memory");
+#endif
+}
+
+// 在 spin 纳秒内忙等数据到来
+static bool ring_spin(ring *r, long long spin)
+{
+    if (spin <= 0)
+        return false;
+
+    long long deadline = now_ns() + spin;
+    while (ring_empty(r))
+    {
+        if (now_ns() >= deadline)
+            return false;
+        cpu_relax();
+    }
+    return true;
+}
+
+static int unixsocket(const char *path, bool listening)
+{
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return -1;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    if (listening)
+    {
+        unlink(path);
+        if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, SOMAXCONN) != 0)
+        {
+            close(sock);
+            return -1;
+        }
+    }
+    else if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// 通过 SCM_RIGHTS 发送/接收 3 个 fd：memfd、c2s 的 eventfd、s2c 的 eventfd
+static int sendfds(int sock, const int fds[3])
+{
+    char byte = 0;
+    struct iovec iov = {&byte, 1};
+
+    union
+    {
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(3 * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, 3 * sizeof(int));
+
+    return sendmsg(sock, &msg, 0) == 1 ? 0 : -1;
+}
+
+static int recvfds(int sock, int fds[3])
+{
+    char byte;
+    struct iovec iov = {&byte, 1};
+
+    union
+    {
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1)
+        return -1;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int)))
+        return -1;
+    memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+    return 0;
+}
+
+/***************************** 服务端 *****************************/
+
+struct client
+{
+    int sock;       // Unix socket，只用于感知客户端退出
+    int c2sfd;      // 客户端写入 c2s 后用它唤醒服务端
+    int s2cfd;      // 服务端写入 s2c 后用它唤醒客户端
+    segment *seg;
+};
+
+static client *clients[MAXCLIENTS];
+
+static void closeclient(int epollfd, int slot)
+{
+    client *c = clients[slot];
+    printf("client(slot=%d) disconnected.\n", slot);
+
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, c->sock, NULL);
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, c->c2sfd, NULL);
+    close(c->sock);
+    close(c->c2sfd);
+    close(c->s2cfd);
+    munmap(c->seg, sizeof(segment));
+    delete c;
+    clients[slot] = NULL;
+}
+
+static int acceptclient(int epollfd, int listensock)
+{
+    int sock = accept4(listensock, NULL, NULL, SOCK_CLOEXEC);
+    if (sock < 0)
+        return -1;
+
+    int slot = 0;
+    while (slot < MAXCLIENTS && clients[slot] != NULL)
+        slot++;
+    if (slot == MAXCLIENTS)
+    {
+        close(sock);
+        return -1;
+    }
+
+    // 共享内存段，mmap 之后内容全为 0，正好是空环的初始状态
+    int memfd = memfd_create("shmring", MFD_CLOEXEC);
+    if (memfd < 0 || ftruncate(memfd, sizeof(segment)) != 0)
+    {
+        perror("memfd_create()");
+        close(sock);
+        return -1;
+    }
+
+    client *c = new client;
+    c->sock = sock;
+    c->seg = (segment *)mmap(NULL, sizeof(segment), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    c->c2sfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    c->s2cfd = eventfd(0, EFD_CLOEXEC);
+
+    int fds[3] = {memfd, c->c2sfd, c->s2cfd};
+    int ret = sendfds(sock, fds);
+    // 客户端 mmap 之后 memfd 就没用了，映射会一直有效
+    close(memfd);
+    clients[slot] = c;
+
+    if (c->seg == MAP_FAILED || ret != 0)
+    {
+        c->seg = NULL;
+        closeclient(epollfd, slot);
+        return -1;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = (uint64_t)slot << 1;          // 最低位 0：Unix socket
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, sock, &ev);
+    ev.data.u64 = ((uint64_t)slot << 1) | 1;    // 最低位 1：eventfd
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, c->c2sfd, &ev);
+
+    printf("client(slot=%d) connected ok.\n", slot);
+    return slot;
+}
+
+/**
+ * 把 c2s 里的消息原样回显到 s2c。返回处理的消息数，-1 表示客户端写了非法的消息；
+ * s2c 满了就先停下，剩下的等客户端取走回复后再处理
+ * */
+static int echo(client *c)
+{
+    int count = 0;
+    uint32_t len;
+    const char *msg;
+    int r;
+
+    while ((r = ring_peek(&c->seg->c2s, &msg, &len)) > 0)
+    {
+        // 数据直接从 c2s 拷贝进 s2c，没有中间缓冲区
+        if (!ring_push(&c->seg->s2c, msg, len))
+            break;
+        ring_pop(&c->seg->c2s, len);
+        count++;
+    }
+
+    if (count > 0)
+        ring_notify(&c->seg->s2c, c->s2cfd);
+    return r < 0 ? -1 : count;
+}
+
+static int runserver(const char *path, long long spin)
+{
+    int listensock = unixsocket(path, true);
+    if (listensock < 0)
+    {
+        printf("listen(%s) failed.\n", path);
+        return -1;
+    }
+    printf("listensock=%d path=%s\n", listensock, path);
+
+    int epollfd = epoll_create1(EPOLL_CLOEXEC);
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = UINT64_MAX;
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, listensock, &ev);
+
+    while (1)
+    {
+        // 轮询所有客户端的 c2s，只要有一个有活干就不阻塞
+        bool busy = false;
+        for (int slot = 0; slot < MAXCLIENTS; slot++)
+        {
+            if (clients[slot] == NULL)
+                continue;
+            int n = echo(clients[slot]);
+            if (n < 0)
+            {
+                printf("client(slot=%d) protocol error.\n", slot);
+                closeclient(epollfd, slot);
+            }
+            else if (n > 0)
+            {
+                busy = true;
+            }
+        }
+
+        // 空闲时先自旋等一会儿，还是没有消息才准备睡眠
+        if (!busy && spin > 0)
+        {
+            long long deadline = now_ns() + spin;
+            while (!busy && now_ns() < deadline)
+            {
+                for (int slot = 0; slot < MAXCLIENTS && !busy; slot++)
+                    busy = clients[slot] != NULL && !ring_empty(&clients[slot]->seg->c2s);
+            }
+        }
+
+        if (!busy)
+        {
+            for (int slot = 0; slot < MAXCLIENTS; slot++)
+            {
+                if (clients[slot] != NULL && !ring_prepare_sleep(&clients[slot]->seg->c2s))
+                    busy = true;
+            }
+        }
+
+        struct epoll_event events[MAXEVENTS];
+        int readyfds = epoll_wait(epollfd, events, MAXEVENTS, busy ? 0 : -1);
+        if (readyfds == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll() failed");
+            break;
+        }
+
+        for (int i = 0; i < readyfds; i++)
+        {
+            uint64_t data = events[i].data.u64;
+            if (data == UINT64_MAX)
+            {
+                acceptclient(epollfd, listensock);
+                continue;
+            }
+
+            int slot = data >> 1;
+            if (clients[slot] == NULL)
+                continue;
+
+            if (data & 1)
+            {
+                // 被客户端唤醒，清掉计数，消息在下一轮统一处理
+                uint64_t count;
+                if (read(clients[slot]->c2sfd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                    perror("read(eventfd)");
+                continue;
+            }
+
+            // Unix socket 可读只会是客户端退出
+            closeclient(epollfd, slot);
+        }
+
+        for (int slot = 0; slot < MAXCLIENTS; slot++)
+        {
+            if (clients[slot] != NULL)
+                clients[slot]->seg->c2s.sleeping.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    close(epollfd);
+    return 0;
+}
+
+/***************************** 客户端 *****************************/
+
+struct connection
+{
+    int sock;
+    int c2sfd;
+    int s2cfd;
+    segment *seg;
+};
+
+static int connectserver(const char *path, connection *conn)
+{
+    conn->sock = unixsocket(path, false);
+    if (conn->sock < 0)
+    {
+        printf("connect(%s) failed.\n", path);
+        return -1;
+    }
+
+    int fds[3];
+    if (recvfds(conn->sock, fds) != 0)
+    {
+        printf("handshake failed.\n");
+        return -1;
+    }
+
+    conn->seg = (segment *)mmap(NULL, sizeof(segment), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+    if (conn->seg == MAP_FAILED)
+    {
+        perror("mmap()");
+        return -1;
+    }
+    conn->c2sfd = fds[1];
+    conn->s2cfd = fds[2];
+    return 0;
+}
+
+static int sendmessage(connection *conn, const char *msg, uint32_t len)
+{
+    // 环满说明服务端处理不过来，让出 CPU 等它
+    while (!ring_push(&conn->seg->c2s, msg, len))
+        sched_yield();
+    ring_notify(&conn->seg->c2s, conn->c2sfd);
+    return 0;
+}
+
+// 等待下一条回复：先自旋，再睡在 eventfd 上。出错或者回复不合法时返回 NULL
+static const char *waitreply(connection *conn, long long spin, uint32_t *len)
+{
+    ring *r = &conn->seg->s2c;
+    for (;;)
+    {
+        const char *msg;
+        int ret = ring_peek(r, &msg, len);
+        if (ret > 0)
+            return msg;
+        if (ret < 0)
+            return NULL;
+        if (ring_spin(r, spin))
+            continue;
+        if (!ring_prepare_sleep(r))
+            continue;
+
+        uint64_t count;
+        if (read(conn->s2cfd, &count, sizeof(count)) < 0)
+            return NULL;
+        r->sleeping.store(0, std::memory_order_relaxed);
+    }
+}
+
+static int runclient(const char *path)
+{
+    connection conn;
+    if (connectserver(path, &conn) != 0)
+        return -1;
+
+    printf("connect ok.\n");
+
+    char buf[1024];
+    while (1)
+    {
+        printf("please input:");
+        if (scanf("%1023s", buf) != 1)
+            break;
+
+        sendmessage(&conn, buf, strlen(buf));
+
+        uint32_t len;
+        const char *reply = waitreply(&conn, 0, &len);
+        if (reply == NULL)
+        {
+            printf("read() failed.\n");
+            return -1;
+        }
+        printf("recv:%.*s\n", (int)len, reply);
+        ring_pop(&conn.seg->s2c, len);
+    }
+    return 0;
+}
+
+static int runbench(const char *path, long msgs, int size, long long spin)
+{
+    connection conn;
+    if (connectserver(path, &conn) != 0)
+        return -1;
+
+    std::vector<char> payload(size, 'x');
+    std::vector<unsigned int> latencies;
+    latencies.reserve(msgs);
+
+    long long start = now_ns();
+    for (long i = 0; i < msgs; i++)
+    {
+        long long t0 = now_ns();
+        sendmessage(&conn, payload.data(), size);
+
+        uint32_t len;
+        if (waitreply(&conn, spin, &len) == NULL || len != (uint32_t)size)
+        {
+            printf("bad reply.\n");
+            return -1;
+        }
+        ring_pop(&conn.seg->s2c, len);
+        latencies.push_back(now_ns() - t0);
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    std::sort(latencies.begin(), latencies.end());
+    printf("transport=shm msgs=%ld size=%d rps=%.0f p50=%.2fus p99=%.2fus p999=%.2fus\n",
+           msgs, size, msgs / seconds,
+           latencies[msgs / 2] / 1000.0, latencies[(size_t)(msgs * 0.99)] / 1000.0,
+           latencies[(size_t)(msgs * 0.999)] / 1000.0);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        printf("usage: ./shmringdemo server path [-p spin_us]\n");
+        printf("       ./shmringdemo client path\n");
+        printf("       ./shmringdemo bench path [-n msgs] [-s size] [-p spin_us]\n");
+        return -1;
+    }
+
+    const char *mode = argv[1];
+    const char *path = argv[2];
+    long msgs = 100000;
+    int size = 64;
+    long long spin = 20;
+
+    optind = 3;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:p:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n': msgs = atol(optarg); break;
+        case 's': size = atoi(optarg); break;
+        case 'p': spin = atoll(optarg); break;
+        default: return -1;
+        }
+    }
+
+    if (msgs <= 0 || size <= 0 || size > MAXMSG)
+    {
+        printf("bad -n or -s.\n");
+        return -1;
+    }
+
+    if (strcmp(mode, "server") == 0)
+        return runserver(path, spin * 1000);
+    if (strcmp(mode, "client") == 0)
+        return runclient(path);
+    if (strcmp(mode, "bench") == 0)
+        return runbench(path, msgs, size, spin * 1000);
+
+    printf("unknown mode: %s\n", mode);
+    return -1;
+}